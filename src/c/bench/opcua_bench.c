@@ -0,0 +1,796 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+/*
+ * Throughput benchmark of the driver. An open62541 server is run in-process
+ * with a configurable number of variable nodes, and the driver is driven
+ * through the same callbacks the device service uses: GET and PUT requests
+ * are issued from a number of threads, and the monitored item changes posted
+ * by the driver are counted. A JSON report of the rates and latency
+ * percentiles is written at the end.
+ */
+
+#include "opcua_driver.h"
+#include "open62541.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define BENCH_DEVICE_RW "bench-rw"
+#define BENCH_DEVICE_NOTIFY "bench-notify"
+#define BENCH_NAME_SIZE 32
+
+typedef struct bench_type
+{
+  const char *name;
+  int uatype;
+  edgex_propertytype type;
+} bench_type;
+
+static const bench_type bench_types[] =
+{
+  { "Boolean", UA_TYPES_BOOLEAN, Bool },
+  { "Int32", UA_TYPES_INT32, Int32 },
+  { "Int64", UA_TYPES_INT64, Int64 },
+  { "Float", UA_TYPES_FLOAT, Float32 },
+  { "Double", UA_TYPES_DOUBLE, Float64 },
+  { "String", UA_TYPES_STRING, String }
+};
+
+/* Latency samples, in microseconds */
+typedef struct bench_samples
+{
+  uint32_t *values;
+  size_t count;
+  size_t size;
+} bench_samples;
+
+typedef struct bench_result
+{
+  const char *name;
+  uint64_t operations;
+  uint64_t values;
+  uint64_t failures;
+  double elapsed;
+  bench_samples samples;
+} bench_result;
+
+typedef struct bench_config
+{
+  uint32_t nodes;
+  const bench_type *type;
+  uint32_t batch;
+  uint32_t threads;
+  uint32_t duration;
+  uint32_t interval;
+  uint16_t port;
+  const char *output;
+  edgex_nvpairs *driver_config;
+} bench_config;
+
+typedef struct bench_state
+{
+  bench_config config;
+  opcua_driver *driver;
+  edgex_protocols protocols;
+  edgex_nvpairs properties[3];
+  char port[8];
+
+  /* One resource per node, for the plain and the monitored device */
+  edgex_deviceresource *resources;
+  edgex_deviceresource *monitored;
+  edgex_nvpairs *attributes;
+  char (*names)[BENCH_NAME_SIZE];
+  edgex_deviceprofile profile_rw;
+  edgex_deviceprofile profile_notify;
+  edgex_device device_rw;
+  edgex_device device_notify;
+  edgex_device_commandrequest *requests;
+
+  /* The in-process server */
+  UA_Server *server;
+  UA_ServerConfig *server_config;
+  pthread_t server_thread;
+  atomic_bool server_running;
+  atomic_bool server_started;
+  uint64_t server_counter;
+
+  /* Notifications posted by the driver while recording */
+  atomic_bool recording;
+  atomic_uint_fast64_t notifications;
+  pthread_mutex_t notify_mutex;
+  bench_samples notify_samples;
+} bench_state;
+
+typedef struct bench_worker
+{
+  bench_state *state;
+  bool put;
+  uint32_t index;
+  pthread_t thread;
+  uint64_t operations;
+  uint64_t values;
+  uint64_t failures;
+  bench_samples samples;
+} bench_worker;
+
+static uint64_t bench_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t bench_wall_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void samples_add(bench_samples *samples, uint64_t value)
+{
+  if (samples->count == samples->size)
+  {
+    samples->size = samples->size ? samples->size * 2 : 4096;
+    samples->values = realloc(samples->values,
+      samples->size * sizeof(uint32_t));
+  }
+  samples->values[samples->count++] =
+    value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+}
+
+static void samples_merge(bench_samples *to, const bench_samples *from)
+{
+  for (size_t i = 0; i < from->count; i++)
+  {
+    samples_add(to, from->values[i]);
+  }
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static uint32_t samples_percentile(const bench_samples *samples, double p)
+{
+  if (samples->count == 0)
+  {
+    return 0;
+  }
+  size_t rank = (size_t)(p / 100.0 * samples->count + 0.5);
+  if (rank > 0)
+  {
+    rank--;
+  }
+  if (rank >= samples->count)
+  {
+    rank = samples->count - 1;
+  }
+  return samples->values[rank];
+}
+
+/* ---- Server stand-in ---- */
+
+static void set_node_value(UA_Variant *value, const bench_type *type,
+  uint64_t counter, void *storage, UA_String *str, char *text)
+{
+  switch (type->uatype)
+  {
+    case UA_TYPES_BOOLEAN:
+      *(UA_Boolean *)storage = counter & 1;
+      break;
+    case UA_TYPES_INT32:
+      *(UA_Int32 *)storage = (UA_Int32)counter;
+      break;
+    case UA_TYPES_INT64:
+      *(UA_Int64 *)storage = (UA_Int64)counter;
+      break;
+    case UA_TYPES_FLOAT:
+      *(UA_Float *)storage = (UA_Float)counter;
+      break;
+    case UA_TYPES_DOUBLE:
+      *(UA_Double *)storage = (UA_Double)counter;
+      break;
+    case UA_TYPES_STRING:
+      sprintf(text, "value-%" PRIu64, counter);
+      *str = UA_STRING(text);
+      storage = str;
+      break;
+  }
+  UA_Variant_setScalar(value, storage, &UA_TYPES[type->uatype]);
+}
+
+static UA_StatusCode add_nodes(bench_state *state)
+{
+  UA_StatusCode status = UA_STATUSCODE_GOOD;
+  const bench_type *type = state->config.type;
+
+  for (uint32_t i = 0; i < state->config.nodes && !status; i++)
+  {
+    UA_Int64 storage;
+    UA_String str;
+    char text[32];
+    UA_VariableAttributes attr = UA_VariableAttributes_default;
+
+    set_node_value(&attr.value, type, 0, &storage, &str, text);
+    attr.dataType = UA_TYPES[type->uatype].typeId;
+    attr.displayName = UA_LOCALIZEDTEXT("en-US", state->names[i]);
+    attr.accessLevel = UA_ACCESSLEVELMASK_READ | UA_ACCESSLEVELMASK_WRITE;
+    status = UA_Server_addVariableNode(state->server,
+      UA_NODEID_STRING(1, state->names[i]),
+      UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER),
+      UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES),
+      UA_QUALIFIEDNAME(1, state->names[i]),
+      UA_NODEID_NUMERIC(0, UA_NS0ID_BASEDATAVARIABLETYPE), attr, NULL, NULL);
+  }
+  return status;
+}
+
+/* Changes every node, so that monitored items have something to report */
+static void update_nodes(bench_state *state)
+{
+  const bench_type *type = state->config.type;
+  state->server_counter++;
+
+  for (uint32_t i = 0; i < state->config.nodes; i++)
+  {
+    UA_Int64 storage;
+    UA_String str;
+    char text[32];
+    UA_Variant value;
+
+    set_node_value(&value, type, state->server_counter + i, &storage, &str,
+      text);
+    UA_Server_writeValue(state->server,
+      UA_NODEID_STRING(1, state->names[i]), value);
+  }
+}
+
+/*
+ * The server is only ever touched from this thread, which iterates it and
+ * updates the node values every interval.
+ */
+static void *server_thread(void *arg)
+{
+  bench_state *state = (bench_state *)arg;
+  uint64_t next = bench_now_us();
+
+  UA_Server_run_startup(state->server);
+  atomic_store(&state->server_started, true);
+  while (atomic_load(&state->server_running))
+  {
+    /* Waits for network activity, for at most the server's own timeout */
+    UA_Server_run_iterate(state->server, true);
+    if (bench_now_us() >= next)
+    {
+      update_nodes(state);
+      next += (uint64_t)state->config.interval * 1000;
+    }
+  }
+  UA_Server_run_shutdown(state->server);
+  return NULL;
+}
+
+static bool server_start(bench_state *state)
+{
+  state->server_config = UA_ServerConfig_new_minimal(state->config.port, NULL);
+  if (!state->server_config)
+  {
+    return false;
+  }
+  state->server = UA_Server_new(state->server_config);
+  if (add_nodes(state) != UA_STATUSCODE_GOOD)
+  {
+    fprintf(stderr, "Failed to add %u nodes to the server\n",
+      state->config.nodes);
+    UA_Server_delete(state->server);
+    UA_ServerConfig_delete(state->server_config);
+    return false;
+  }
+
+  atomic_store(&state->server_running, true);
+  pthread_create(&state->server_thread, NULL, server_thread, state);
+  while (!atomic_load(&state->server_started))
+  {
+    usleep(1000);
+  }
+  return true;
+}
+
+static void server_stop(bench_state *state)
+{
+  atomic_store(&state->server_running, false);
+  pthread_join(state->server_thread, NULL);
+  UA_Server_delete(state->server);
+  UA_ServerConfig_delete(state->server_config);
+}
+
+/* ---- Device service stand-in ---- */
+
+static edgex_device *bench_get_device(void *ctx, const char *name)
+{
+  bench_state *state = (bench_state *)ctx;
+  if (!strcmp(name, BENCH_DEVICE_NOTIFY))
+  {
+    return &state->device_notify;
+  }
+  if (!strcmp(name, BENCH_DEVICE_RW))
+  {
+    return &state->device_rw;
+  }
+  return NULL;
+}
+
+/* The benchmark's devices are connected by its own requests */
+static edgex_device *bench_get_devices(void *ctx)
+{
+  return NULL;
+}
+
+static void bench_free_device(void *ctx, edgex_device *device)
+{
+}
+
+static void bench_post_readings(void *ctx, const char *devname,
+  const char *resname, uint32_t nvalues,
+  const edgex_device_commandresult *values)
+{
+  bench_state *state = (bench_state *)ctx;
+  if (!atomic_load(&state->recording))
+  {
+    return;
+  }
+
+  /* Origins are in milliseconds, so this is only accurate to those */
+  uint64_t now = bench_wall_ms();
+  uint64_t latency = now > values->origin ? now - values->origin : 0;
+  atomic_fetch_add(&state->notifications, 1);
+  pthread_mutex_lock(&state->notify_mutex);
+  samples_add(&state->notify_samples, latency * 1000);
+  pthread_mutex_unlock(&state->notify_mutex);
+}
+
+static void setup_devices(bench_state *state)
+{
+  uint32_t n = state->config.nodes;
+  char interval[16];
+
+  snprintf(state->port, sizeof(state->port), "%u", state->config.port);
+  state->properties[0] = (edgex_nvpairs) { "Address", "127.0.0.1",
+    &state->properties[1] };
+  state->properties[1] = (edgex_nvpairs) { "Port", state->port,
+    &state->properties[2] };
+  state->properties[2] = (edgex_nvpairs) { "Path", "/", NULL };
+  state->protocols.name = "OPC-UA";
+  state->protocols.properties = state->properties;
+  state->protocols.next = NULL;
+
+  /*
+   * Each resource has nodeID, nsIndex and IDType attributes, and the
+   * monitored ones add monitored and samplingInterval.
+   */
+  snprintf(interval, sizeof(interval), "%u", state->config.interval);
+  state->names = calloc(n, BENCH_NAME_SIZE);
+  state->resources = calloc(n, sizeof(edgex_deviceresource));
+  state->monitored = calloc(n, sizeof(edgex_deviceresource));
+  state->attributes = calloc(n * 5, sizeof(edgex_nvpairs));
+  state->requests = calloc(n, sizeof(edgex_device_commandrequest));
+  for (uint32_t i = 0; i < n; i++)
+  {
+    edgex_nvpairs *attrs = &state->attributes[i * 5];
+    snprintf(state->names[i], BENCH_NAME_SIZE, "bench.%u", i);
+    attrs[0] = (edgex_nvpairs) { "nodeID", state->names[i], &attrs[1] };
+    attrs[1] = (edgex_nvpairs) { "nsIndex", "1", &attrs[2] };
+    attrs[2] = (edgex_nvpairs) { "IDType", "STRING", NULL };
+    attrs[3] = (edgex_nvpairs) { "monitored", "True", &attrs[4] };
+    attrs[4] = (edgex_nvpairs) { "samplingInterval", strdup(interval),
+      &attrs[0] };
+
+    state->resources[i].name = state->names[i];
+    state->resources[i].attributes = &attrs[0];
+    state->resources[i].next = (i + 1 < n) ? &state->resources[i + 1] : NULL;
+    state->monitored[i].name = state->names[i];
+    state->monitored[i].attributes = &attrs[3];
+    state->monitored[i].next = (i + 1 < n) ? &state->monitored[i + 1] : NULL;
+
+    state->requests[i].resname = state->names[i];
+    state->requests[i].attributes = &attrs[0];
+    state->requests[i].type = state->config.type->type;
+  }
+
+  state->profile_rw.name = "bench";
+  state->profile_rw.device_resources = state->resources;
+  state->profile_notify.name = "bench-monitored";
+  state->profile_notify.device_resources = state->monitored;
+  state->device_rw.name = BENCH_DEVICE_RW;
+  state->device_rw.protocols = &state->protocols;
+  state->device_rw.profile = &state->profile_rw;
+  state->device_notify.name = BENCH_DEVICE_NOTIFY;
+  state->device_notify.protocols = &state->protocols;
+  state->device_notify.profile = &state->profile_notify;
+}
+
+static void free_devices(bench_state *state)
+{
+  for (uint32_t i = 0; i < state->config.nodes; i++)
+  {
+    free(state->attributes[i * 5 + 4].value);
+  }
+  free(state->requests);
+  free(state->attributes);
+  free(state->monitored);
+  free(state->resources);
+  free(state->names);
+}
+
+/* ---- GET and PUT ---- */
+
+static void set_put_value(edgex_device_commandresult *result,
+  const bench_type *type, uint64_t counter, char *text)
+{
+  memset(result, 0, sizeof(edgex_device_commandresult));
+  result->type = type->type;
+  switch (type->type)
+  {
+    case Bool: result->value.bool_result = counter & 1; break;
+    case Int32: result->value.i32_result = (int32_t)counter; break;
+    case Int64: result->value.i64_result = (int64_t)counter; break;
+    case Float32: result->value.f32_result = (float)counter; break;
+    case Float64: result->value.f64_result = (double)counter; break;
+    case String:
+      sprintf(text, "put-%" PRIu64, counter);
+      result->value.string_result = text;
+      break;
+    default: break;
+  }
+}
+
+static void *worker_thread(void *arg)
+{
+  bench_worker *worker = (bench_worker *)arg;
+  bench_state *state = worker->state;
+  const bench_config *config = &state->config;
+  uint32_t batch = config->batch;
+  uint32_t starts = config->nodes - batch + 1;
+  edgex_device_commandresult *results =
+    calloc(batch, sizeof(edgex_device_commandresult));
+  char (*text)[32] = calloc(batch, 32);
+  uint64_t end = bench_now_us() + (uint64_t)config->duration * 1000000;
+  uint64_t k = worker->index;
+
+  while (bench_now_us() < end)
+  {
+    uint32_t first = (uint32_t)((k * batch) % starts);
+    const edgex_device_commandrequest *requests = &state->requests[first];
+    bool ok;
+    k += config->threads;
+
+    uint64_t start = bench_now_us();
+    if (worker->put)
+    {
+      for (uint32_t i = 0; i < batch; i++)
+      {
+        set_put_value(&results[i], config->type, k + i, text[i]);
+      }
+      ok = opcua_put_handler(state->driver, BENCH_DEVICE_RW,
+        &state->protocols, batch, requests, results);
+    }
+    else
+    {
+      memset(results, 0, batch * sizeof(edgex_device_commandresult));
+      ok = opcua_get_handler(state->driver, BENCH_DEVICE_RW,
+        &state->protocols, batch, requests, results);
+      if (ok && config->type->type == String)
+      {
+        for (uint32_t i = 0; i < batch; i++)
+        {
+          free(results[i].value.string_result);
+        }
+      }
+    }
+    samples_add(&worker->samples, bench_now_us() - start);
+
+    worker->operations++;
+    if (ok)
+    {
+      worker->values += batch;
+    }
+    else
+    {
+      worker->failures++;
+    }
+  }
+
+  free(text);
+  free(results);
+  return NULL;
+}
+
+static void run_requests(bench_state *state, bench_result *result, bool put)
+{
+  uint32_t nthreads = state->config.threads;
+  bench_worker *workers = calloc(nthreads, sizeof(bench_worker));
+  uint64_t start = bench_now_us();
+
+  for (uint32_t i = 0; i < nthreads; i++)
+  {
+    workers[i].state = state;
+    workers[i].put = put;
+    workers[i].index = i;
+    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+  }
+  for (uint32_t i = 0; i < nthreads; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    result->operations += workers[i].operations;
+    result->values += workers[i].values;
+    result->failures += workers[i].failures;
+    samples_merge(&result->samples, &workers[i].samples);
+    free(workers[i].samples.values);
+  }
+  result->elapsed = (bench_now_us() - start) / 1e6;
+  free(workers);
+}
+
+/* ---- Notifications ---- */
+
+static void run_notifications(bench_state *state, bench_result *result)
+{
+  edgex_device_commandresult reading;
+
+  /* A first request attaches the device and so subscribes to its nodes */
+  memset(&reading, 0, sizeof(reading));
+  if (opcua_get_handler(state->driver, BENCH_DEVICE_NOTIFY, &state->protocols,
+    1, state->requests, &reading) && state->config.type->type == String)
+  {
+    free(reading.value.string_result);
+  }
+
+  /* Allow the subscriptions to settle before counting */
+  usleep(1000 * (state->config.interval * 2 + 500));
+
+  uint64_t start = bench_now_us();
+  atomic_store(&state->recording, true);
+  sleep(state->config.duration);
+  atomic_store(&state->recording, false);
+  result->elapsed = (bench_now_us() - start) / 1e6;
+
+  pthread_mutex_lock(&state->notify_mutex);
+  result->values = atomic_load(&state->notifications);
+  result->operations = result->values;
+  samples_merge(&result->samples, &state->notify_samples);
+  pthread_mutex_unlock(&state->notify_mutex);
+}
+
+/* ---- Report ---- */
+
+static void write_result(FILE *out, const bench_result *result, bool last)
+{
+  double elapsed = result->elapsed > 0.0 ? result->elapsed : 1.0;
+  fprintf(out, "  \"%s\": {\n", result->name);
+  fprintf(out, "    \"operations\": %" PRIu64 ",\n", result->operations);
+  fprintf(out, "    \"values\": %" PRIu64 ",\n", result->values);
+  fprintf(out, "    \"failures\": %" PRIu64 ",\n", result->failures);
+  fprintf(out, "    \"seconds\": %.3f,\n", result->elapsed);
+  fprintf(out, "    \"operations_per_sec\": %.1f,\n",
+    result->operations / elapsed);
+  fprintf(out, "    \"values_per_sec\": %.1f,\n", result->values / elapsed);
+  fprintf(out, "    \"latency_us\": { \"p50\": %u, \"p90\": %u, \"p99\": %u, "
+    "\"p999\": %u, \"max\": %u }\n",
+    samples_percentile(&result->samples, 50.0),
+    samples_percentile(&result->samples, 90.0),
+    samples_percentile(&result->samples, 99.0),
+    samples_percentile(&result->samples, 99.9),
+    samples_percentile(&result->samples, 100.0));
+  fprintf(out, "  }%s\n", last ? "" : ",");
+}
+
+static void write_report(FILE *out, const bench_config *config,
+  bench_result *results, size_t nresults)
+{
+  fprintf(out, "{\n");
+  fprintf(out, "  \"config\": { \"nodes\": %u, \"type\": \"%s\", "
+    "\"batch\": %u, \"threads\": %u, \"duration\": %u, \"interval\": %u },\n",
+    config->nodes, config->type->name, config->batch, config->threads,
+    config->duration, config->interval);
+  for (size_t i = 0; i < nresults; i++)
+  {
+    qsort(results[i].samples.values, results[i].samples.count,
+      sizeof(uint32_t), compare_samples);
+    write_result(out, &results[i], i + 1 == nresults);
+  }
+  fprintf(out, "}\n");
+}
+
+/* ---- Options ---- */
+
+static void usage(void)
+{
+  printf("Options: \n");
+  printf("   -h              : Show this text\n");
+  printf("   -n <nodes>      : Number of server nodes (default 100)\n");
+  printf("   -t <type>       : Node type: Boolean, Int32, Int64, Float, "
+    "Double or String (default Int32)\n");
+  printf("   -b <batch>      : Values per GET or PUT request (default 10)\n");
+  printf("   -j <threads>    : Threads issuing requests (default 1)\n");
+  printf("   -d <seconds>    : Duration of each phase (default 5)\n");
+  printf("   -i <ms>         : Node update and sampling interval "
+    "(default 100)\n");
+  printf("   -p <port>       : Server port (default 48400)\n");
+  printf("   -o <file>       : Write the report to a file, not stdout\n");
+  printf("   -D <Name=Value> : Set a [Driver] option, may be repeated\n");
+}
+
+static const bench_type *parse_type(const char *name)
+{
+  for (size_t i = 0; i < sizeof(bench_types) / sizeof(bench_types[0]); i++)
+  {
+    if (!strcmp(name, bench_types[i].name))
+    {
+      return &bench_types[i];
+    }
+  }
+  return NULL;
+}
+
+static bool add_driver_option(bench_config *config, char *option)
+{
+  char *eq = strchr(option, '=');
+  if (!eq || eq == option)
+  {
+    return false;
+  }
+  edgex_nvpairs *nvp = malloc(sizeof(edgex_nvpairs));
+  nvp->name = strndup(option, eq - option);
+  nvp->value = strdup(eq + 1);
+  nvp->next = config->driver_config;
+  config->driver_config = nvp;
+  return true;
+}
+
+static void free_driver_options(edgex_nvpairs *nvp)
+{
+  while (nvp)
+  {
+    edgex_nvpairs *next = nvp->next;
+    free(nvp->name);
+    free(nvp->value);
+    free(nvp);
+    nvp = next;
+  }
+}
+
+static bool parse_options(int argc, char *argv[], bench_config *config)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "hn:t:b:j:d:i:p:o:D:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': config->nodes = strtoul(optarg, NULL, 10); break;
+      case 't': config->type = parse_type(optarg); break;
+      case 'b': config->batch = strtoul(optarg, NULL, 10); break;
+      case 'j': config->threads = strtoul(optarg, NULL, 10); break;
+      case 'd': config->duration = strtoul(optarg, NULL, 10); break;
+      case 'i': config->interval = strtoul(optarg, NULL, 10); break;
+      case 'p': config->port = (uint16_t)strtoul(optarg, NULL, 10); break;
+      case 'o': config->output = optarg; break;
+      case 'D':
+        if (!add_driver_option(config, optarg))
+        {
+          return false;
+        }
+        break;
+      default: return false;
+    }
+  }
+  if (!config->type || !config->nodes || !config->threads ||
+    !config->duration || !config->interval || !config->batch ||
+    config->batch > config->nodes)
+  {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  bench_state *state = calloc(1, sizeof(bench_state));
+  bench_config *config = &state->config;
+  bench_result results[3] =
+  {
+    { .name = "get" }, { .name = "put" }, { .name = "notify" }
+  };
+  FILE *out = stdout;
+  int rc = 1;
+
+  config->nodes = 100;
+  config->type = parse_type("Int32");
+  config->batch = 10;
+  config->threads = 1;
+  config->duration = 5;
+  config->interval = 100;
+  config->port = 48400;
+  if (!parse_options(argc, argv, config))
+  {
+    usage();
+    goto done;
+  }
+  if (config->output && !(out = fopen(config->output, "w")))
+  {
+    fprintf(stderr, "Unable to open %s\n", config->output);
+    goto done;
+  }
+
+  pthread_mutex_init(&state->notify_mutex, NULL);
+  setup_devices(state);
+  if (!server_start(state))
+  {
+    fprintf(stderr, "Failed to start the server on port %u\n", config->port);
+    goto devices;
+  }
+
+  opcua_service_ops ops =
+  {
+    bench_get_device,
+    bench_get_devices,
+    bench_free_device,
+    bench_post_readings,
+    state
+  };
+  state->driver = opcua_driver_new(&ops);
+  if (!opcua_init(state->driver, iot_logger_default(), config->driver_config))
+  {
+    fprintf(stderr, "Failed to initialise the driver\n");
+    opcua_driver_free(state->driver);
+    server_stop(state);
+    goto devices;
+  }
+
+  fprintf(stderr, "Running GET for %us\n", config->duration);
+  run_requests(state, &results[0], false);
+  fprintf(stderr, "Running PUT for %us\n", config->duration);
+  run_requests(state, &results[1], true);
+  fprintf(stderr, "Running notifications for %us\n", config->duration);
+  run_notifications(state, &results[2]);
+
+  opcua_stop(state->driver, false);
+  opcua_driver_free(state->driver);
+  server_stop(state);
+
+  write_report(out, config, results, 3);
+  rc = 0;
+
+devices:
+  free_devices(state);
+  pthread_mutex_destroy(&state->notify_mutex);
+done:
+  for (size_t i = 0; i < 3; i++)
+  {
+    free(results[i].samples.values);
+  }
+  free(state->notify_samples.values);
+  if (out && out != stdout)
+  {
+    fclose(out);
+  }
+  free_driver_options(config->driver_config);
+  free(state);
+  return rc;
+}
@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+/*
+ * Micro-benchmarks of the per-reading paths: parsing of node ids from
+ * resource attributes, the resource cache lookups made for requests and
+ * subscriptions, and the conversion of values in each direction. Each case
+ * is timed over a number of iterations and reported as nanoseconds and heap
+ * allocations per operation, as JSON.
+ */
+
+#include "opcua_resource.h"
+#include "opcua_convert.h"
+#include "opcua_arena.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+#define BENCH_ARRAY_LENGTH 256
+
+/*
+ * With glibc the allocator is wrapped to count calls, including those made
+ * by open62541 and the SDK. Elsewhere allocations are not reported.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_uint_fast64_t bench_allocs;
+
+void *malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+#define BENCH_COUNTS_ALLOCS true
+#define BENCH_ALLOCS() atomic_load(&bench_allocs)
+#else
+#define BENCH_COUNTS_ALLOCS false
+#define BENCH_ALLOCS() 0
+#endif
+
+typedef struct bench_case
+{
+  const char *name;
+  void (*run)(void *arg);
+  void *arg;
+} bench_case;
+
+static iot_logger_t *bench_lc;
+static opcua_resource_cache bench_cache;
+static opcua_arena bench_arena;
+static volatile uint64_t bench_sink;
+
+static uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ---- Node ids ---- */
+
+typedef struct nodeid_arg
+{
+  edgex_nvpairs attrs[3];
+  edgex_deviceresource resource;
+  edgex_device_commandrequest request;
+} nodeid_arg;
+
+static void nodeid_arg_init(nodeid_arg *arg, const char *name,
+  const char *type, const char *id)
+{
+  arg->attrs[0] = (edgex_nvpairs) { "nodeID", (char *)id, &arg->attrs[1] };
+  arg->attrs[1] = (edgex_nvpairs) { "nsIndex", "2", &arg->attrs[2] };
+  arg->attrs[2] = (edgex_nvpairs) { "IDType", (char *)type, NULL };
+  arg->resource.name = (char *)name;
+  arg->resource.attributes = arg->attrs;
+  arg->request.resname = name;
+  arg->request.attributes = arg->attrs;
+  arg->request.type = Int32;
+}
+
+static void run_parse_resource(void *arg)
+{
+  nodeid_arg *n = (nodeid_arg *)arg;
+  opcua_resource res;
+  UA_NodeId id = opcua_parse_resource(n->attrs, &res);
+  bench_sink += id.identifierType;
+}
+
+static void run_get_resource(void *arg)
+{
+  nodeid_arg *n = (nodeid_arg *)arg;
+  opcua_resource *res =
+    opcua_get_resource(&bench_cache, "bench", &n->request);
+  bench_sink += res->nodeId.namespaceIndex;
+  opcua_resource_release(res);
+}
+
+static void run_get_subscription_resource(void *arg)
+{
+  nodeid_arg *n = (nodeid_arg *)arg;
+  opcua_resource *res =
+    opcua_get_subscription_resource(&bench_cache, "bench", &n->resource);
+  bench_sink += (res != NULL);
+  opcua_resource_release(res);
+}
+
+/* ---- Reading values ---- */
+
+typedef struct read_arg
+{
+  UA_Variant value;
+  union
+  {
+    UA_Boolean b;
+    UA_Byte u8;
+    UA_UInt16 u16;
+    UA_UInt32 u32;
+    UA_UInt64 u64;
+    UA_SByte i8;
+    UA_Int16 i16;
+    UA_Int32 i32;
+    UA_Int64 i64;
+    UA_Float f32;
+    UA_Double f64;
+    UA_String str;
+  } data;
+  char *text;
+  void *array;
+} read_arg;
+
+static void read_arg_scalar(read_arg *arg, int type)
+{
+  UA_Variant_setScalar(&arg->value, &arg->data, &UA_TYPES[type]);
+  arg->value.storageType = UA_VARIANT_DATA_NODELETE;
+}
+
+static void read_arg_string(read_arg *arg, size_t len)
+{
+  arg->text = malloc(len + 1);
+  memset(arg->text, 'x', len);
+  arg->text[len] = '\0';
+  arg->data.str = UA_STRING(arg->text);
+  read_arg_scalar(arg, UA_TYPES_STRING);
+}
+
+static void read_arg_array(read_arg *arg, int type)
+{
+  arg->array = calloc(BENCH_ARRAY_LENGTH, UA_TYPES[type].memSize);
+  UA_Variant_setArray(&arg->value, arg->array, BENCH_ARRAY_LENGTH,
+    &UA_TYPES[type]);
+  arg->value.storageType = UA_VARIANT_DATA_NODELETE;
+}
+
+/* A reading for a GET: strings are allocated for the SDK to free */
+static void run_read_get(void *arg)
+{
+  read_arg *r = (read_arg *)arg;
+  edgex_device_commandresult result = opcua_to_edgex(&r->value, bench_lc,
+    NULL);
+  if (result.type == String)
+  {
+    free(result.value.string_result);
+  }
+  bench_sink += result.type;
+}
+
+/* A notification: strings and arrays are copied into the arena */
+static void run_read_notify(void *arg)
+{
+  read_arg *r = (read_arg *)arg;
+  edgex_device_commandresult result = opcua_to_edgex(&r->value, bench_lc,
+    &bench_arena);
+  opcua_arena_reset(&bench_arena);
+  bench_sink += result.type;
+}
+
+/* ---- Writing values ---- */
+
+typedef struct write_arg
+{
+  edgex_device_commandresult result;
+  const UA_DataType *arrayType;
+  char *text;
+} write_arg;
+
+static void run_write(void *arg)
+{
+  write_arg *w = (write_arg *)arg;
+  UA_Variant value;
+  UA_String string;
+  bench_sink += edgex_to_opcua(&w->result, w->arrayType, &value, &string,
+    bench_lc);
+}
+
+/* ---- Last values ---- */
+
+typedef struct last_arg
+{
+  opcua_last_value last;
+  char *text;
+} last_arg;
+
+/* A GET answered from the last notified value */
+static void run_last_value_get(void *arg)
+{
+  last_arg *l = (last_arg *)arg;
+  edgex_device_commandresult result;
+  if (opcua_last_value_get(&l->last, 1000, l->last.received, &result) &&
+    result.type == String)
+  {
+    free(result.value.string_result);
+  }
+  bench_sink += result.type;
+}
+
+/* ---- Cases ---- */
+
+#define NODEID_CASES 5
+#define READ_CASES 17
+#define WRITE_CASES 16
+#define LAST_CASES 2
+
+static nodeid_arg nodeid_args[NODEID_CASES];
+static read_arg read_args[READ_CASES];
+static write_arg write_args[WRITE_CASES];
+static last_arg last_args[LAST_CASES];
+static bench_case bench_cases[NODEID_CASES * 3 + READ_CASES * 2 +
+  WRITE_CASES + LAST_CASES];
+static size_t bench_ncases;
+
+static void add_case(const char *prefix, const char *name,
+  void (*run)(void *arg), void *arg)
+{
+  char *full = malloc(strlen(prefix) + strlen(name) + 2);
+  sprintf(full, "%s/%s", prefix, name);
+  bench_cases[bench_ncases++] = (bench_case) { full, run, arg };
+}
+
+static void setup_nodeid_cases(void)
+{
+  static const struct
+  {
+    const char *name;
+    const char *type;
+    const char *id;
+  } ids[NODEID_CASES] =
+  {
+    { "numeric", "NUMERIC", "1001" },
+    { "string-short", "STRING", "Temp" },
+    { "string-long", "STRING",
+      "Plant.Line4.Cell12.Station3.Drive.MotorTemperature.Value" },
+    { "bytestring", "BYTESTRING", "Zm9vYmFy" },
+    { "guid", "GUID", "72962B91-FA75-4AE6-8D28-B404DC7DAF63" }
+  };
+
+  for (size_t i = 0; i < NODEID_CASES; i++)
+  {
+    nodeid_arg_init(&nodeid_args[i], ids[i].name, ids[i].type, ids[i].id);
+    add_case("parse_resource", ids[i].name, run_parse_resource,
+      &nodeid_args[i]);
+  }
+  for (size_t i = 0; i < NODEID_CASES; i++)
+  {
+    add_case("get_resource", ids[i].name, run_get_resource, &nodeid_args[i]);
+  }
+  for (size_t i = 0; i < NODEID_CASES; i++)
+  {
+    add_case("get_subscription_resource", ids[i].name,
+      run_get_subscription_resource, &nodeid_args[i]);
+  }
+}
+
+static void setup_read_cases(void)
+{
+  static const struct
+  {
+    const char *name;
+    int type;
+  } scalars[] =
+  {
+    { "Boolean", UA_TYPES_BOOLEAN },
+    { "Byte", UA_TYPES_BYTE },
+    { "UInt16", UA_TYPES_UINT16 },
+    { "UInt32", UA_TYPES_UINT32 },
+    { "UInt64", UA_TYPES_UINT64 },
+    { "SByte", UA_TYPES_SBYTE },
+    { "Int16", UA_TYPES_INT16 },
+    { "Int32", UA_TYPES_INT32 },
+    { "Int64", UA_TYPES_INT64 },
+    { "DateTime", UA_TYPES_DATETIME },
+    { "Float", UA_TYPES_FLOAT },
+    { "Double", UA_TYPES_DOUBLE }
+  };
+  static const struct
+  {
+    const char *name;
+    size_t len;
+  } strings[] =
+  {
+    { "String-8", 8 },
+    { "String-64", 64 },
+    { "String-1024", 1024 }
+  };
+  size_t n = 0;
+
+  for (size_t i = 0; i < sizeof(scalars) / sizeof(scalars[0]); i++, n++)
+  {
+    memset(&read_args[n].data, 0, sizeof(read_args[n].data));
+    read_arg_scalar(&read_args[n], scalars[i].type);
+    add_case("opcua_to_edgex", scalars[i].name, run_read_get, &read_args[n]);
+  }
+  for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++, n++)
+  {
+    read_arg_string(&read_args[n], strings[i].len);
+    add_case("opcua_to_edgex", strings[i].name, run_read_get, &read_args[n]);
+    add_case("opcua_to_edgex_arena", strings[i].name, run_read_notify,
+      &read_args[n]);
+  }
+  read_arg_array(&read_args[n], UA_TYPES_INT32);
+  add_case("opcua_to_edgex_arena", "Int32[256]", run_read_notify,
+    &read_args[n++]);
+  read_arg_array(&read_args[n], UA_TYPES_DOUBLE);
+  add_case("opcua_to_edgex_arena", "Double[256]", run_read_notify,
+    &read_args[n++]);
+}
+
+static void setup_write_cases(void)
+{
+  static const struct
+  {
+    const char *name;
+    edgex_propertytype type;
+  } scalars[] =
+  {
+    { "Bool", Bool },
+    { "Uint8", Uint8 },
+    { "Uint16", Uint16 },
+    { "Uint32", Uint32 },
+    { "Uint64", Uint64 },
+    { "Int8", Int8 },
+    { "Int16", Int16 },
+    { "Int32", Int32 },
+    { "Int64", Int64 },
+    { "Float32", Float32 },
+    { "Float64", Float64 }
+  };
+  static const struct
+  {
+    const char *name;
+    size_t len;
+  } strings[] =
+  {
+    { "String-8", 8 },
+    { "String-64", 64 },
+    { "String-1024", 1024 }
+  };
+  size_t n = 0;
+
+  for (size_t i = 0; i < sizeof(scalars) / sizeof(scalars[0]); i++, n++)
+  {
+    write_args[n].result.type = scalars[i].type;
+    add_case("edgex_to_opcua", scalars[i].name, run_write, &write_args[n]);
+  }
+  for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++, n++)
+  {
+    write_args[n].text = malloc(strings[i].len + 1);
+    memset(write_args[n].text, 'x', strings[i].len);
+    write_args[n].text[strings[i].len] = '\0';
+    write_args[n].result.type = String;
+    write_args[n].result.value.string_result = write_args[n].text;
+    add_case("edgex_to_opcua", strings[i].name, run_write, &write_args[n]);
+  }
+  write_args[n].text = calloc(BENCH_ARRAY_LENGTH, sizeof(UA_Int32));
+  write_args[n].result.type = Binary;
+  write_args[n].result.value.binary_result.bytes =
+    (uint8_t *)write_args[n].text;
+  write_args[n].result.value.binary_result.size =
+    BENCH_ARRAY_LENGTH * sizeof(UA_Int32);
+  write_args[n].arrayType = opcua_parse_array_type("Int32");
+  add_case("edgex_to_opcua", "Binary-Int32[256]", run_write, &write_args[n++]);
+  write_args[n].text = calloc(BENCH_ARRAY_LENGTH, sizeof(UA_Double));
+  write_args[n].result.type = Binary;
+  write_args[n].result.value.binary_result.bytes =
+    (uint8_t *)write_args[n].text;
+  write_args[n].result.value.binary_result.size =
+    BENCH_ARRAY_LENGTH * sizeof(UA_Double);
+  write_args[n].arrayType = opcua_parse_array_type("Double");
+  add_case("edgex_to_opcua", "Binary-Double[256]", run_write,
+    &write_args[n++]);
+}
+
+static void setup_last_cases(void)
+{
+  edgex_device_commandresult value;
+
+  for (size_t i = 0; i < LAST_CASES; i++)
+  {
+    pthread_mutex_init(&last_args[i].last.mutex, NULL);
+  }
+
+  memset(&value, 0, sizeof(value));
+  value.type = Int32;
+  opcua_last_value_store(&last_args[0].last, &value, 1);
+  add_case("last_value_get", "Int32", run_last_value_get, &last_args[0]);
+
+  last_args[1].text = malloc(65);
+  memset(last_args[1].text, 'x', 64);
+  last_args[1].text[64] = '\0';
+  value.type = String;
+  value.value.string_result = last_args[1].text;
+  opcua_last_value_store(&last_args[1].last, &value, 1);
+  add_case("last_value_get", "String-64", run_last_value_get, &last_args[1]);
+}
+
+static void free_cases(void)
+{
+  for (size_t i = 0; i < bench_ncases; i++)
+  {
+    free((char *)bench_cases[i].name);
+  }
+  for (size_t i = 0; i < READ_CASES; i++)
+  {
+    free(read_args[i].text);
+    free(read_args[i].array);
+  }
+  for (size_t i = 0; i < WRITE_CASES; i++)
+  {
+    free(write_args[i].text);
+  }
+  for (size_t i = 0; i < LAST_CASES; i++)
+  {
+    pthread_mutex_destroy(&last_args[i].last.mutex);
+    free(last_args[i].last.buffer);
+    free(last_args[i].text);
+  }
+}
+
+/* ---- Running ---- */
+
+static void run_case(FILE *out, const bench_case *c, uint64_t iterations,
+  bool last)
+{
+  /* Warm up, which also fills the resource cache */
+  for (uint64_t i = 0; i < iterations / 100 + 1; i++)
+  {
+    c->run(c->arg);
+  }
+
+  uint64_t allocs = BENCH_ALLOCS();
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    c->run(c->arg);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  allocs = BENCH_ALLOCS() - allocs;
+
+  fprintf(out, "    { \"name\": \"%s\", \"ns_per_op\": %.1f, ", c->name,
+    (double)elapsed / iterations);
+  if (BENCH_COUNTS_ALLOCS)
+  {
+    fprintf(out, "\"allocs_per_op\": %.3f }", (double)allocs / iterations);
+  }
+  else
+  {
+    fprintf(out, "\"allocs_per_op\": null }");
+  }
+  fprintf(out, "%s\n", last ? "" : ",");
+}
+
+static void usage(void)
+{
+  printf("Options: \n");
+  printf("   -h              : Show this text\n");
+  printf("   -n <iterations> : Iterations of each case (default %u)\n",
+    BENCH_DEFAULT_ITERATIONS);
+  printf("   -f <filter>     : Only run the cases whose name contains this\n");
+  printf("   -o <file>       : Write the report to a file, not stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t iterations = BENCH_DEFAULT_ITERATIONS;
+  const char *filter = NULL;
+  const char *output = NULL;
+  FILE *out = stdout;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hn:f:o:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': iterations = strtoull(optarg, NULL, 10); break;
+      case 'f': filter = optarg; break;
+      case 'o': output = optarg; break;
+      default: usage(); return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (!iterations)
+  {
+    usage();
+    return 1;
+  }
+  if (output && !(out = fopen(output, "w")))
+  {
+    fprintf(stderr, "Unable to open %s\n", output);
+    return 1;
+  }
+
+  bench_lc = iot_logger_default();
+  opcua_resource_cache_init(&bench_cache);
+  opcua_arena_init(&bench_arena);
+  setup_nodeid_cases();
+  setup_read_cases();
+  setup_write_cases();
+  setup_last_cases();
+
+  size_t selected = 0;
+  for (size_t i = 0; i < bench_ncases; i++)
+  {
+    if (!filter || strstr(bench_cases[i].name, filter))
+    {
+      selected++;
+    }
+  }
+
+  fprintf(out, "{\n  \"iterations\": %" PRIu64 ",\n  \"cases\": [\n",
+    iterations);
+  for (size_t i = 0; i < bench_ncases; i++)
+  {
+    if (!filter || strstr(bench_cases[i].name, filter))
+    {
+      run_case(out, &bench_cases[i], iterations, --selected == 0);
+    }
+  }
+  fprintf(out, "  ]\n}\n");
+
+  free_cases();
+  opcua_arena_fini(&bench_arena);
+  opcua_resource_cache_fini(&bench_cache);
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+  return 0;
+}
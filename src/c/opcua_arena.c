@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define OPCUA_ARENA_CHUNK_SIZE 4096
+#define OPCUA_ARENA_ALIGN(n) \
+  (((n) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+void opcua_arena_init(opcua_arena *arena)
+{
+  arena->chunks = NULL;
+  arena->current = NULL;
+}
+
+void opcua_arena_fini(opcua_arena *arena)
+{
+  while (arena->chunks)
+  {
+    opcua_arena_chunk *next = arena->chunks->next;
+    free(arena->chunks);
+    arena->chunks = next;
+  }
+  arena->current = NULL;
+}
+
+void *opcua_arena_alloc(opcua_arena *arena, size_t size)
+{
+  opcua_arena_chunk *chunk = arena->current;
+  void *result;
+
+  size = OPCUA_ARENA_ALIGN(size);
+
+  /* Move on through the chunks kept from before the last reset */
+  while (chunk && chunk->used + size > chunk->size)
+  {
+    chunk = chunk->next;
+    if (chunk)
+      arena->current = chunk;
+  }
+
+  if (!chunk)
+  {
+    size_t csize = size > OPCUA_ARENA_CHUNK_SIZE ? size : OPCUA_ARENA_CHUNK_SIZE;
+    chunk = malloc(sizeof(opcua_arena_chunk) + csize);
+    chunk->size = csize;
+    chunk->used = 0;
+    chunk->next = NULL;
+    if (arena->current)
+      arena->current->next = chunk;
+    else
+      arena->chunks = chunk;
+    arena->current = chunk;
+  }
+
+  result = chunk->data + chunk->used;
+  chunk->used += size;
+  return result;
+}
+
+char *opcua_arena_strndup(opcua_arena *arena, const char *str, size_t len)
+{
+  char *copy = opcua_arena_alloc(arena, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+void opcua_arena_reset(opcua_arena *arena)
+{
+  for (opcua_arena_chunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+  {
+    chunk->used = 0;
+  }
+  arena->current = arena->chunks;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_ARENA_H_
+#define _OPCUA_ARENA_H_
+
+#include <stdalign.h>
+#include <stddef.h>
+
+/*
+ * Bump allocator for short-lived data. Everything allocated is released at
+ * once by a reset, which keeps the memory for reuse so that an arena which
+ * has reached its working size makes no further calls to malloc. The arena
+ * does no locking of its own.
+ */
+
+typedef struct opcua_arena_chunk
+{
+  struct opcua_arena_chunk *next;
+  size_t size;
+  size_t used;
+  alignas(max_align_t) char data[];
+} opcua_arena_chunk;
+
+typedef struct opcua_arena
+{
+  opcua_arena_chunk *chunks;
+  opcua_arena_chunk *current;
+} opcua_arena;
+
+extern void opcua_arena_init(opcua_arena *arena);
+extern void opcua_arena_fini(opcua_arena *arena);
+
+/* Returns size bytes, aligned for any type, valid until the next reset */
+extern void *opcua_arena_alloc(opcua_arena *arena, size_t size);
+
+/* Returns a NUL terminated copy of len bytes of str */
+extern char *opcua_arena_strndup(opcua_arena *arena, const char *str,
+  size_t len);
+
+/* Releases everything allocated, keeping the chunks for reuse */
+extern void opcua_arena_reset(opcua_arena *arena);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_convert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Switch over the OPCUA data types and map those applicable to edgex types */
+edgex_device_commandresult opcua_to_edgex(UA_Variant *value,
+  iot_logger_t *lc, opcua_arena *arena)
+{
+  edgex_device_commandresult result;
+  memset(&result, 0, sizeof(edgex_device_commandresult));
+
+  /*
+   * If we've connected to the server too quickly during it's start up, it is
+   * possible to get a malformed UA_Variant passed to us - attempt to deal with
+   * this gracefully.
+   */
+  if (!value || !value->type)
+  {
+    iot_log_debug(lc, "Malformed UA_Variant.");
+    return result;
+  }
+
+  /*
+   * Arrays of fixed size elements map to Binary, as their contiguous buffer.
+   * Multi-dimensional arrays are flattened in the server's (row major) order.
+   */
+  if (!UA_Variant_isScalar(value))
+  {
+    size_t size = value->arrayLength * value->type->memSize;
+    if (!value->type->pointerFree)
+    {
+      iot_log_error(lc, "Arrays of %s not supported!",
+        value->type->typeName);
+      return result;
+    }
+    iot_log_debug(lc, "Reading array of %zu %s.", value->arrayLength,
+      value->type->typeName);
+    result.type = Binary;
+    result.value.binary_result.size = size;
+    if (arena)
+    {
+      /* Notifications are posted from the arena, copy the array in bulk */
+      result.value.binary_result.bytes = opcua_arena_alloc(arena, size);
+      memcpy(result.value.binary_result.bytes, value->data, size);
+    }
+    else if (size)
+    {
+      /* Take over the decoded array, leaving the variant empty */
+      result.value.binary_result.bytes = value->data;
+      value->data = NULL;
+      value->arrayLength = 0;
+    }
+    return result;
+  }
+
+  switch (value->type->typeIndex)
+  {
+    case UA_TYPES_BOOLEAN:
+      result.type = Bool;
+      result.value.bool_result = *(UA_Boolean *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %d.",
+                     value->type->typeName, result.value.bool_result);
+      break;
+    case UA_TYPES_STRING:
+      result.type = String;
+      UA_String data = *(UA_String *)value->data;
+      char *convert;
+      if (arena)
+      {
+        convert = opcua_arena_strndup(arena, (const char *)data.data,
+          data.length);
+      }
+      else
+      {
+        convert = (char *)malloc(sizeof (char) * data.length + 1);
+        memcpy(convert, data.data, data.length);
+        convert[data.length] = '\0';
+      }
+      result.value.string_result = convert;
+      iot_log_debug(lc, "Reading data of type %s with value %s.",
+                     value->type->typeName, result.value.string_result);
+      break;
+    case UA_TYPES_BYTE:
+      result.type = Uint8;
+      result.value.ui8_result = *(UA_Byte *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %u.",
+                     value->type->typeName, result.value.ui8_result);
+      break;
+    case UA_TYPES_UINT16:
+      result.type = Uint16;
+      result.value.ui16_result = *(UA_UInt16 *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %u.",
+                     value->type->typeName, result.value.ui16_result);
+      break;
+    case UA_TYPES_UINT32:
+      result.type = Uint32;
+      result.value.ui32_result = *(UA_UInt32 *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %u.",
+                     value->type->typeName, result.value.ui32_result);
+      break;
+    case UA_TYPES_UINT64:
+      result.type = Uint64;
+      result.value.ui64_result = *(UA_UInt64 *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %lu.",
+                     value->type->typeName, result.value.ui64_result);
+      break;
+    case UA_TYPES_SBYTE:
+      result.type = Int8;
+      result.value.i8_result = *(UA_SByte *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %d.",
+                     value->type->typeName, result.value.i8_result);
+      break;
+    case UA_TYPES_INT16:
+      result.type = Int16;
+      result.value.i16_result = *(UA_Int16 *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %d.",
+                     value->type->typeName, result.value.i16_result);
+      break;
+    case UA_TYPES_INT32:
+      result.type = Int32;
+      result.value.i32_result = *(UA_Int32 *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %d.",
+                     value->type->typeName, result.value.i32_result);
+      break;
+    case UA_TYPES_DATETIME:
+    case UA_TYPES_INT64:
+      result.type = Int64;
+      result.value.i64_result = *(UA_Int64 *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %ld.",
+                     value->type->typeName, result.value.i64_result);
+      break;
+    case UA_TYPES_FLOAT:
+      result.type = Float32;
+      result.value.f32_result = *(UA_Float *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %f.",
+                     value->type->typeName, result.value.f32_result);
+      break;
+    case UA_TYPES_DOUBLE:
+      result.type = Float64;
+      result.value.f64_result = *(UA_Double *)value->data;
+      iot_log_debug(lc, "Reading data of type %s with value %lf.",
+                     value->type->typeName, result.value.f64_result);
+      break;
+    default:
+      iot_log_error(lc, "Type %s not supported!",value->type->typeName);
+      break;
+  }
+  return result;
+}
+
+/* Switch over edgex types, map to OPC-UA */
+bool edgex_to_opcua(const edgex_device_commandresult *result,
+  const UA_DataType *arrayType, UA_Variant *value, UA_String *string,
+  iot_logger_t *lc)
+{
+  UA_Variant_init(value);
+  switch (result->type)
+  {
+    case Bool:
+      UA_Variant_setScalar(value, (void *)&result->value.bool_result,
+        &UA_TYPES[UA_TYPES_BOOLEAN]);
+      iot_log_debug(lc, "Writing data of type %s with value %d.",
+                     value->type->typeName, result->value.bool_result);
+      break;
+    case String:
+    {
+      *string = UA_STRING(result->value.string_result);
+      UA_Variant_setScalar(value, string, &UA_TYPES[UA_TYPES_STRING]);
+      iot_log_debug(lc, "Writing data of type %s with value %s.",
+                     value->type->typeName, result->value.string_result);
+      break;
+    }
+    case Uint8:
+      UA_Variant_setScalar(value, (void *)&result->value.ui8_result,
+        &UA_TYPES[UA_TYPES_BYTE]);
+      iot_log_debug(lc, "Writing data of type %s with value %u.",
+                     value->type->typeName, result->value.ui8_result);
+      break;
+    case Uint16:
+      UA_Variant_setScalar(value, (void *)&result->value.ui16_result,
+        &UA_TYPES[UA_TYPES_UINT16]);
+      iot_log_debug(lc, "Writing data of type %s with value %u.",
+                     value->type->typeName, result->value.ui16_result);
+      break;
+    case Uint32:
+      UA_Variant_setScalar(value, (void *)&result->value.ui32_result,
+        &UA_TYPES[UA_TYPES_UINT32]);
+      iot_log_debug(lc, "Writing data of type %s with value %u.",
+                     value->type->typeName, result->value.ui32_result);
+      break;
+    case Uint64:
+      UA_Variant_setScalar(value, (void *)&result->value.ui64_result,
+        &UA_TYPES[UA_TYPES_UINT64]);
+      iot_log_debug(lc, "Writing data of type %s with value %lu.",
+                     value->type->typeName, result->value.ui64_result);
+      break;
+    case Int8:
+      UA_Variant_setScalar(value, (void *)&result->value.i8_result,
+        &UA_TYPES[UA_TYPES_SBYTE]);
+      iot_log_debug(lc, "Writing data of type %s with value %d.",
+                     value->type->typeName, result->value.i8_result);
+      break;
+    case Int16:
+      UA_Variant_setScalar(value, (void *)&result->value.i16_result,
+        &UA_TYPES[UA_TYPES_INT16]);
+      iot_log_debug(lc, "Writing data of type %s with value %d.",
+                     value->type->typeName, result->value.i16_result);
+      break;
+    case Int32:
+      UA_Variant_setScalar(value, (void *)&result->value.i32_result,
+        &UA_TYPES[UA_TYPES_INT32]);
+      iot_log_debug(lc, "Writing data of type %s with value %d.",
+                     value->type->typeName, result->value.i32_result);
+      break;
+    case Int64:
+      UA_Variant_setScalar(value, (void *)&result->value.i64_result,
+        &UA_TYPES[UA_TYPES_INT64]);
+      iot_log_debug(lc, "Writing data of type %s with value %ld.",
+                     value->type->typeName, result->value.i64_result);
+      break;
+    case Float32:
+      UA_Variant_setScalar(value, (void *)&result->value.f32_result,
+        &UA_TYPES[UA_TYPES_FLOAT]);
+      iot_log_debug(lc, "Writing data of type %s with value %f.",
+                     value->type->typeName, result->value.f32_result);
+      break;
+    case Float64:
+      UA_Variant_setScalar(value, (void *)&result->value.f64_result,
+        &UA_TYPES[UA_TYPES_DOUBLE]);
+      iot_log_debug(lc, "Writing data of type %s with value %lf.",
+                     value->type->typeName, result->value.f64_result);
+      break;
+    case Binary:
+    {
+      size_t size = result->value.binary_result.size;
+      if (!arrayType || size % arrayType->memSize)
+      {
+        iot_log_error(lc,
+          "Binary value of %zu bytes can't be written as an array of %s",
+          size, arrayType ? arrayType->typeName : "unspecified type");
+        return false;
+      }
+      UA_Variant_setArray(value, result->value.binary_result.bytes,
+        size / arrayType->memSize, arrayType);
+      iot_log_debug(lc, "Writing array of %zu %s.",
+                     value->arrayLength, arrayType->typeName);
+      break;
+    }
+    default:
+      iot_log_error(lc, "Type %d not supported!", result->type);
+      return false;
+  }
+  value->storageType = UA_VARIANT_DATA_NODELETE;
+  return true;
+}
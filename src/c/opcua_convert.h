@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_CONVERT_H_
+#define _OPCUA_CONVERT_H_
+
+#include "edgex/devsdk.h"
+#include "open62541.h"
+#include "opcua_arena.h"
+
+/*
+ * Convert a value read from the server. A string or array is copied into the
+ * arena if one is given, otherwise it is handed to the caller to free.
+ */
+extern edgex_device_commandresult opcua_to_edgex(UA_Variant *value,
+  iot_logger_t *lc, opcua_arena *arena);
+
+/*
+ * Point a variant at a value to be written, without copying it. The value,
+ * and the string header for a String, must outlive the variant. A Binary
+ * value is written as an array of arrayType elements. Returns false if the
+ * type is not supported.
+ */
+extern bool edgex_to_opcua(const edgex_device_commandresult *result,
+  const UA_DataType *arrayType, UA_Variant *value, UA_String *string,
+  iot_logger_t *lc);
+
+#endif
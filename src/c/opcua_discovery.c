@@ -0,0 +1,1105 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_discovery.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* References returned per node before a continuation point is needed */
+#define OPCUA_BROWSE_MAX_REFS 1000
+/* Time in milliseconds the client waits for responses in each iteration */
+#define OPCUA_DISCOVERY_RUN 50
+/* Attributes read for each variable: DataType, ValueRank and AccessLevel */
+#define OPCUA_VARIABLE_ATTRS 3
+#define OPCUA_ATTRIBUTEID_VALUERANK 15
+#define OPCUA_ATTRIBUTEID_ACCESSLEVEL 17
+#define OPCUA_ACCESSLEVEL_READ 0x01
+#define OPCUA_ACCESSLEVEL_WRITE 0x02
+/* ns=0;i=2257, the time at which the server was last started */
+#define OPCUA_NS0ID_STARTTIME 2257
+
+/* A reference from a browsed node to an object or variable */
+typedef struct discovered_ref
+{
+  UA_NodeId nodeId;
+  char *name;
+  UA_NodeClass nodeClass;
+} discovered_ref;
+
+/*
+ * The references of a browsed node. A node is complete once the last of its
+ * continuation points has been followed, and is then browsed again when it
+ * expires.
+ */
+typedef struct browsed_node
+{
+  bool complete;
+  uint64_t expires;
+  size_t nrefs;
+  size_t size;
+  discovered_ref *refs;
+} browsed_node;
+
+/* The attributes of a variable which decide its deviceResource */
+typedef struct variable_info
+{
+  uint64_t expires;
+  /* Numeric id of a namespace 0 data type, otherwise 0 */
+  uint32_t dataType;
+  int32_t valueRank;
+  uint8_t accessLevel;
+} variable_info;
+
+/* What is known of a server's address space, keyed by node */
+typedef struct discovered_server
+{
+  UA_DateTime startTime;
+  opcua_map nodes;
+  opcua_map variables;
+} discovered_server;
+
+/* A node waiting to be browsed, at a number of levels below the root */
+typedef struct frontier_entry
+{
+  UA_NodeId nodeId;
+  uint32_t depth;
+} frontier_entry;
+
+/* A continuation point of a node, to be followed with BrowseNext */
+typedef struct continuation
+{
+  UA_ByteString point;
+  browsed_node *node;
+  uint32_t depth;
+} continuation;
+
+/* A variable found by the browse, whose node id belongs to the cache */
+typedef struct discovered_var
+{
+  const UA_NodeId *nodeId;
+  const char *name;
+  char *key;
+  const variable_info *info;
+} discovered_var;
+
+/*
+ * The state of one discovery run. Responses are handled by the client on
+ * the thread running discovery, so none of it is locked.
+ */
+typedef struct discovery_job
+{
+  iot_logger_t *lc;
+  const opcua_discovery_params *params;
+  UA_Client *client;
+  discovered_server *server;
+  uint64_t now;
+  /* Time of the last request or response, for the timeout */
+  uint64_t progress;
+  uint32_t inflight;
+  uint32_t requests;
+  bool failed;
+  /* Nodes to browse, as a queue */
+  frontier_entry *frontier;
+  size_t head;
+  size_t tail;
+  size_t frontier_size;
+  continuation *next;
+  size_t nnext;
+  size_t next_size;
+  /* Nodes already queued or reported */
+  opcua_map seen;
+  discovered_var *vars;
+  size_t nvars;
+  size_t vars_size;
+} discovery_job;
+
+/* The nodes of a Browse or BrowseNext request, in the order sent */
+typedef struct browse_context
+{
+  discovery_job *job;
+  uint32_t n;
+  browsed_node **nodes;
+  uint32_t *depths;
+} browse_context;
+
+/* The variables of a Read request, as indexes of the job's variables */
+typedef struct read_context
+{
+  discovery_job *job;
+  uint32_t n;
+  size_t *vars;
+} read_context;
+
+/* Supported data types, by their numeric id in namespace 0 */
+static const struct
+{
+  uint32_t id;
+  const char *edgexType;
+  /* Element type name for an arrayType attribute, NULL if not supported */
+  const char *arrayType;
+} opcua_discovery_types[] =
+{
+  { 1, "Bool", "Boolean" },
+  { 2, "Int8", "SByte" },
+  { 3, "Uint8", "Byte" },
+  { 4, "Int16", "Int16" },
+  { 5, "Uint16", "UInt16" },
+  { 6, "Int32", "Int32" },
+  { 7, "Uint32", "UInt32" },
+  { 8, "Int64", "Int64" },
+  { 9, "Uint64", "UInt64" },
+  { 10, "Float32", "Float" },
+  { 11, "Float64", "Double" },
+  { 12, "String", NULL },
+  { 13, "Int64", "DateTime" }
+};
+
+static uint64_t discovery_now(void)
+{
+  return (uint64_t)(UA_DateTime_nowMonotonic() / UA_DATETIME_MSEC);
+}
+
+/* A string key for a node id, allocated */
+static char *node_key(const UA_NodeId *id)
+{
+  char *key = NULL;
+  size_t len;
+
+  switch (id->identifierType)
+  {
+    case UA_NODEIDTYPE_NUMERIC:
+      len = (size_t)snprintf(NULL, 0, "ns=%u;i=%u", id->namespaceIndex,
+        id->identifier.numeric);
+      key = malloc(len + 1);
+      sprintf(key, "ns=%u;i=%u", id->namespaceIndex, id->identifier.numeric);
+      break;
+    case UA_NODEIDTYPE_GUID:
+    {
+      const UA_Guid *g = &id->identifier.guid;
+      key = malloc(64);
+      snprintf(key, 64, "ns=%u;g=" UA_PRINTF_GUID_FORMAT, id->namespaceIndex,
+        g->data1, g->data2, g->data3, g->data4[0], g->data4[1], g->data4[2],
+        g->data4[3], g->data4[4], g->data4[5], g->data4[6], g->data4[7]);
+      break;
+    }
+    default:
+    {
+      /* Strings and byte strings, the latter in hex */
+      const UA_String *s = &id->identifier.string;
+      bool hex = (id->identifierType == UA_NODEIDTYPE_BYTESTRING);
+      len = (size_t)snprintf(NULL, 0, "ns=%u;s=", id->namespaceIndex);
+      key = malloc(len + (hex ? 2 * s->length : s->length) + 1);
+      sprintf(key, "ns=%u;%c=", id->namespaceIndex, hex ? 'b' : 's');
+      for (size_t i = 0; i < s->length; i++)
+      {
+        if (hex)
+          len += (size_t)sprintf(key + len, "%02x", s->data[i]);
+        else
+          key[len++] = (char)s->data[i];
+      }
+      key[len] = '\0';
+      break;
+    }
+  }
+  return key;
+}
+
+bool opcua_parse_nodeid_string(const char *str, UA_NodeId *nodeId)
+{
+  unsigned long ns = 0;
+  char *end;
+
+  if (!strncmp(str, "ns=", 3))
+  {
+    ns = strtoul(str + 3, &end, 10);
+    if (end == str + 3 || *end != ';' || ns > UINT16_MAX)
+      return false;
+    str = end + 1;
+  }
+  if (!strncmp(str, "i=", 2))
+  {
+    unsigned long id = strtoul(str + 2, &end, 10);
+    if (end == str + 2 || *end != '\0')
+      return false;
+    *nodeId = UA_NODEID_NUMERIC((UA_UInt16)ns, (UA_UInt32)id);
+    return true;
+  }
+  if (!strncmp(str, "s=", 2) && str[2])
+  {
+    *nodeId = UA_NODEID_STRING_ALLOC((UA_UInt16)ns, str + 2);
+    return true;
+  }
+  return false;
+}
+
+static void free_browsed_refs(browsed_node *node)
+{
+  for (size_t i = 0; i < node->nrefs; i++)
+  {
+    UA_NodeId_deleteMembers(&node->refs[i].nodeId);
+    free(node->refs[i].name);
+  }
+  node->nrefs = 0;
+}
+
+static void free_browsed_node(void *value)
+{
+  browsed_node *node = (browsed_node *)value;
+  free_browsed_refs(node);
+  free(node->refs);
+  free(node);
+}
+
+static void free_server(void *value)
+{
+  discovered_server *server = (discovered_server *)value;
+  opcua_map_fini(&server->nodes, free_browsed_node);
+  opcua_map_fini(&server->variables, free);
+  free(server);
+}
+
+void opcua_discovery_init(opcua_discovery *disc)
+{
+  pthread_mutex_init(&disc->mutex, NULL);
+  opcua_map_init(&disc->servers);
+}
+
+void opcua_discovery_fini(opcua_discovery *disc)
+{
+  opcua_map_fini(&disc->servers, free_server);
+  pthread_mutex_destroy(&disc->mutex);
+}
+
+static bool namespace_wanted(const opcua_discovery_params *params,
+  UA_UInt16 ns)
+{
+  if (params->nnamespaces == 0)
+    return true;
+  for (uint32_t i = 0; i < params->nnamespaces; i++)
+  {
+    if (params->namespaces[i] == ns)
+      return true;
+  }
+  return false;
+}
+
+/* Mark a node as seen, returning false if it already was */
+static bool discovery_see(discovery_job *job, const char *key)
+{
+  if (opcua_map_get(&job->seen, key))
+    return false;
+  opcua_map_put(&job->seen, key, job);
+  return true;
+}
+
+static void push_frontier(discovery_job *job, const UA_NodeId *nodeId,
+  uint32_t depth)
+{
+  if (job->tail == job->frontier_size)
+  {
+    /* Reclaim the space of the nodes already taken before growing */
+    if (job->head)
+    {
+      memmove(job->frontier, job->frontier + job->head,
+        (job->tail - job->head) * sizeof(frontier_entry));
+      job->tail -= job->head;
+      job->head = 0;
+    }
+    if (job->tail == job->frontier_size)
+    {
+      job->frontier_size = job->frontier_size ? 2 * job->frontier_size : 64;
+      job->frontier = realloc(job->frontier,
+        job->frontier_size * sizeof(frontier_entry));
+    }
+  }
+  UA_NodeId_copy(nodeId, &job->frontier[job->tail].nodeId);
+  job->frontier[job->tail].depth = depth;
+  job->tail++;
+}
+
+static void push_variable(discovery_job *job, const discovered_ref *ref,
+  char *key)
+{
+  if (job->nvars == job->vars_size)
+  {
+    job->vars_size = job->vars_size ? 2 * job->vars_size : 64;
+    job->vars = realloc(job->vars, job->vars_size * sizeof(discovered_var));
+  }
+  job->vars[job->nvars].nodeId = &ref->nodeId;
+  job->vars[job->nvars].name = ref->name;
+  job->vars[job->nvars].key = key;
+  job->vars[job->nvars].info = NULL;
+  job->nvars++;
+}
+
+/*
+ * Follow the references of a completely browsed node: variables are
+ * reported, and objects are queued to be browsed in turn while within the
+ * depth limit.
+ */
+static void expand_node(discovery_job *job, const browsed_node *node,
+  uint32_t depth)
+{
+  const opcua_discovery_params *params = job->params;
+
+  for (size_t i = 0; i < node->nrefs; i++)
+  {
+    const discovered_ref *ref = &node->refs[i];
+    bool follow = (params->depth == 0 || depth + 1 < params->depth);
+    char *key;
+
+    if (!namespace_wanted(params, ref->nodeId.namespaceIndex))
+      continue;
+    if (ref->nodeClass != UA_NODECLASS_VARIABLE &&
+      !(ref->nodeClass == UA_NODECLASS_OBJECT && follow))
+    {
+      continue;
+    }
+    key = node_key(&ref->nodeId);
+    if (!discovery_see(job, key))
+    {
+      free(key);
+      continue;
+    }
+    if (ref->nodeClass == UA_NODECLASS_VARIABLE)
+    {
+      push_variable(job, ref, key);
+    }
+    else
+    {
+      push_frontier(job, &ref->nodeId, depth + 1);
+      free(key);
+    }
+  }
+}
+
+static void add_refs(browsed_node *node, const UA_BrowseResult *result)
+{
+  if (node->nrefs + result->referencesSize > node->size)
+  {
+    node->size = node->nrefs + result->referencesSize;
+    node->refs = realloc(node->refs, node->size * sizeof(discovered_ref));
+  }
+  for (size_t i = 0; i < result->referencesSize; i++)
+  {
+    const UA_ReferenceDescription *rd = &result->references[i];
+    discovered_ref *ref;
+
+    /* References to other servers can't be read through this one */
+    if (rd->nodeId.serverIndex != 0)
+      continue;
+    ref = &node->refs[node->nrefs++];
+    UA_NodeId_copy(&rd->nodeId.nodeId, &ref->nodeId);
+    ref->name = malloc(rd->browseName.name.length + 1);
+    memcpy(ref->name, rd->browseName.name.data, rd->browseName.name.length);
+    ref->name[rd->browseName.name.length] = '\0';
+    ref->nodeClass = rd->nodeClass;
+  }
+}
+
+static void browse_results(browse_context *ctx, UA_StatusCode status,
+  size_t nresults, const UA_BrowseResult *results)
+{
+  discovery_job *job = ctx->job;
+
+  job->inflight--;
+  job->progress = discovery_now();
+  if (status != UA_STATUSCODE_GOOD || nresults != ctx->n)
+  {
+    if (!job->failed)
+    {
+      iot_log_error(job->lc, "Browse failed. Status Code: %s",
+        UA_StatusCode_name(status));
+    }
+    job->failed = true;
+    goto done;
+  }
+
+  for (uint32_t i = 0; i < ctx->n; i++)
+  {
+    browsed_node *node = ctx->nodes[i];
+    const UA_BrowseResult *result = &results[i];
+
+    if (result->statusCode != UA_STATUSCODE_GOOD)
+    {
+      /* Report what was found, but browse the node again next time */
+      iot_log_debug(job->lc, "Browse of a node failed. Status Code: %s",
+        UA_StatusCode_name(result->statusCode));
+      node->complete = true;
+      node->expires = 0;
+      expand_node(job, node, ctx->depths[i]);
+      continue;
+    }
+    add_refs(node, result);
+    if (result->continuationPoint.length)
+    {
+      continuation *cp;
+      if (job->nnext == job->next_size)
+      {
+        job->next_size = job->next_size ? 2 * job->next_size : 16;
+        job->next = realloc(job->next,
+          job->next_size * sizeof(continuation));
+      }
+      cp = &job->next[job->nnext++];
+      UA_ByteString_copy(&result->continuationPoint, &cp->point);
+      cp->node = node;
+      cp->depth = ctx->depths[i];
+    }
+    else
+    {
+      node->complete = true;
+      node->expires = job->now + job->params->ttl;
+      expand_node(job, node, ctx->depths[i]);
+    }
+  }
+
+done:
+  free(ctx->nodes);
+  free(ctx->depths);
+  free(ctx);
+}
+
+static void browse_complete(UA_Client *client, void *userdata,
+  UA_UInt32 requestId, void *response)
+{
+  UA_BrowseResponse *resp = (UA_BrowseResponse *)response;
+  browse_results((browse_context *)userdata,
+    resp->responseHeader.serviceResult, resp->resultsSize, resp->results);
+}
+
+static void browse_next_complete(UA_Client *client, void *userdata,
+  UA_UInt32 requestId, void *response)
+{
+  UA_BrowseNextResponse *resp = (UA_BrowseNextResponse *)response;
+  browse_results((browse_context *)userdata,
+    resp->responseHeader.serviceResult, resp->resultsSize, resp->results);
+}
+
+static browse_context *new_browse_context(discovery_job *job)
+{
+  browse_context *ctx = malloc(sizeof(browse_context));
+  ctx->job = job;
+  ctx->n = 0;
+  ctx->nodes = calloc(job->params->batch, sizeof(browsed_node *));
+  ctx->depths = calloc(job->params->batch, sizeof(uint32_t));
+  return ctx;
+}
+
+static void request_sent(discovery_job *job, UA_StatusCode retval,
+  const char *what)
+{
+  job->progress = discovery_now();
+  if (retval == UA_STATUSCODE_GOOD)
+  {
+    job->inflight++;
+    job->requests++;
+  }
+  else
+  {
+    iot_log_error(job->lc, "Failed to send %s request. Status Code: %s",
+      what, UA_StatusCode_name(retval));
+    job->failed = true;
+  }
+}
+
+/*
+ * Send a Browse of the next batch of queued nodes. Nodes whose references
+ * are cached and have not expired are expanded without a request.
+ */
+static void send_browse(discovery_job *job)
+{
+  const opcua_discovery_params *params = job->params;
+  UA_BrowseDescription *descs = calloc(params->batch,
+    sizeof(UA_BrowseDescription));
+  browse_context *ctx = new_browse_context(job);
+  UA_BrowseRequest request;
+  UA_StatusCode retval;
+
+  while (ctx->n < params->batch && job->head < job->tail)
+  {
+    frontier_entry entry = job->frontier[job->head++];
+    char *key = node_key(&entry.nodeId);
+    browsed_node *node = opcua_map_get(&job->server->nodes, key);
+
+    if (node && node->complete && node->expires > job->now)
+    {
+      expand_node(job, node, entry.depth);
+      UA_NodeId_deleteMembers(&entry.nodeId);
+      free(key);
+      continue;
+    }
+    if (node)
+    {
+      free_browsed_refs(node);
+    }
+    else
+    {
+      node = calloc(1, sizeof(browsed_node));
+      opcua_map_put(&job->server->nodes, key, node);
+    }
+    free(key);
+    node->complete = false;
+
+    UA_BrowseDescription_init(&descs[ctx->n]);
+    descs[ctx->n].nodeId = entry.nodeId;
+    descs[ctx->n].browseDirection = UA_BROWSEDIRECTION_FORWARD;
+    descs[ctx->n].referenceTypeId =
+      UA_NODEID_NUMERIC(0, UA_NS0ID_HIERARCHICALREFERENCES);
+    descs[ctx->n].includeSubtypes = true;
+    descs[ctx->n].nodeClassMask = UA_NODECLASS_OBJECT | UA_NODECLASS_VARIABLE;
+    descs[ctx->n].resultMask = UA_BROWSERESULTMASK_ALL;
+    ctx->nodes[ctx->n] = node;
+    ctx->depths[ctx->n] = entry.depth;
+    ctx->n++;
+  }
+
+  if (ctx->n)
+  {
+    UA_BrowseRequest_init(&request);
+    request.requestedMaxReferencesPerNode = OPCUA_BROWSE_MAX_REFS;
+    request.nodesToBrowse = descs;
+    request.nodesToBrowseSize = ctx->n;
+    retval = __UA_Client_AsyncService(job->client, &request,
+      &UA_TYPES[UA_TYPES_BROWSEREQUEST], browse_complete,
+      &UA_TYPES[UA_TYPES_BROWSERESPONSE], ctx, NULL);
+    request_sent(job, retval, "Browse");
+    for (uint32_t i = 0; i < ctx->n; i++)
+      UA_NodeId_deleteMembers(&descs[i].nodeId);
+    ctx = (retval == UA_STATUSCODE_GOOD) ? NULL : ctx;
+  }
+  if (ctx)
+  {
+    free(ctx->nodes);
+    free(ctx->depths);
+    free(ctx);
+  }
+  free(descs);
+}
+
+/* Send a BrowseNext of a batch of outstanding continuation points */
+static void send_browse_next(discovery_job *job)
+{
+  uint32_t n = (job->nnext < job->params->batch) ?
+    (uint32_t)job->nnext : job->params->batch;
+  UA_ByteString *points = calloc(n, sizeof(UA_ByteString));
+  browse_context *ctx = new_browse_context(job);
+  UA_BrowseNextRequest request;
+  UA_StatusCode retval;
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    continuation *cp = &job->next[--job->nnext];
+    points[i] = cp->point;
+    ctx->nodes[i] = cp->node;
+    ctx->depths[i] = cp->depth;
+  }
+  ctx->n = n;
+
+  UA_BrowseNextRequest_init(&request);
+  request.releaseContinuationPoints = false;
+  request.continuationPoints = points;
+  request.continuationPointsSize = n;
+  retval = __UA_Client_AsyncService(job->client, &request,
+    &UA_TYPES[UA_TYPES_BROWSENEXTREQUEST], browse_next_complete,
+    &UA_TYPES[UA_TYPES_BROWSENEXTRESPONSE], ctx, NULL);
+  request_sent(job, retval, "BrowseNext");
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    free(ctx->nodes);
+    free(ctx->depths);
+    free(ctx);
+  }
+  for (uint32_t i = 0; i < n; i++)
+    UA_ByteString_deleteMembers(&points[i]);
+  free(points);
+}
+
+/* Run the client until a response arrives or the wait times out */
+static void discovery_wait(discovery_job *job)
+{
+  UA_StatusCode retval = UA_Client_runAsync(job->client, OPCUA_DISCOVERY_RUN);
+
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    iot_log_error(job->lc, "Discovery connection failed. Status Code: %s",
+      UA_StatusCode_name(retval));
+    job->failed = true;
+  }
+  else if (job->inflight &&
+    discovery_now() - job->progress > job->params->timeout)
+  {
+    iot_log_error(job->lc, "Discovery timed out waiting for the server");
+    job->failed = true;
+  }
+}
+
+static void browse_address_space(discovery_job *job)
+{
+  const opcua_discovery_params *params = job->params;
+  char *key = node_key(&params->root);
+
+  discovery_see(job, key);
+  free(key);
+  push_frontier(job, &params->root, 0);
+
+  while (!job->failed &&
+    (job->head < job->tail || job->nnext || job->inflight))
+  {
+    while (!job->failed && job->inflight < params->inflight &&
+      (job->nnext || job->head < job->tail))
+    {
+      if (job->nnext)
+        send_browse_next(job);
+      else
+        send_browse(job);
+    }
+    if (job->inflight)
+      discovery_wait(job);
+  }
+}
+
+static void read_complete(UA_Client *client, void *userdata,
+  UA_UInt32 requestId, void *response)
+{
+  read_context *ctx = (read_context *)userdata;
+  discovery_job *job = ctx->job;
+  UA_ReadResponse *resp = (UA_ReadResponse *)response;
+
+  job->inflight--;
+  job->progress = discovery_now();
+  if (resp->responseHeader.serviceResult != UA_STATUSCODE_GOOD ||
+    resp->resultsSize != ctx->n * OPCUA_VARIABLE_ATTRS)
+  {
+    if (!job->failed)
+    {
+      iot_log_error(job->lc, "Read of variable attributes failed. "
+        "Status Code: %s",
+        UA_StatusCode_name(resp->responseHeader.serviceResult));
+    }
+    job->failed = true;
+    goto done;
+  }
+
+  for (uint32_t i = 0; i < ctx->n; i++)
+  {
+    discovered_var *var = &job->vars[ctx->vars[i]];
+    const UA_DataValue *dv = &resp->results[i * OPCUA_VARIABLE_ATTRS];
+    variable_info *info = opcua_map_get(&job->server->variables, var->key);
+
+    if (!info)
+    {
+      info = malloc(sizeof(variable_info));
+      opcua_map_put(&job->server->variables, var->key, info);
+    }
+    memset(info, 0, sizeof(variable_info));
+    info->expires = job->now + job->params->ttl;
+    if (dv[0].hasValue && dv[0].value.type == &UA_TYPES[UA_TYPES_NODEID])
+    {
+      const UA_NodeId *type = (const UA_NodeId *)dv[0].value.data;
+      if (type->namespaceIndex == 0 &&
+        type->identifierType == UA_NODEIDTYPE_NUMERIC)
+      {
+        info->dataType = type->identifier.numeric;
+      }
+    }
+    if (dv[1].hasValue && dv[1].value.type == &UA_TYPES[UA_TYPES_INT32])
+      info->valueRank = *(const UA_Int32 *)dv[1].value.data;
+    if (dv[2].hasValue && dv[2].value.type == &UA_TYPES[UA_TYPES_BYTE])
+      info->accessLevel = *(const UA_Byte *)dv[2].value.data;
+    var->info = info;
+  }
+
+done:
+  free(ctx->vars);
+  free(ctx);
+}
+
+/* Send a Read of the attributes of the next batch of variables */
+static void send_read(discovery_job *job, size_t *pos)
+{
+  const opcua_discovery_params *params = job->params;
+  UA_ReadValueId *ids = calloc(params->batch * OPCUA_VARIABLE_ATTRS,
+    sizeof(UA_ReadValueId));
+  read_context *ctx = malloc(sizeof(read_context));
+  UA_ReadRequest request;
+  UA_StatusCode retval;
+  static const UA_UInt32 attrs[OPCUA_VARIABLE_ATTRS] =
+  {
+    UA_ATTRIBUTEID_DATATYPE,
+    OPCUA_ATTRIBUTEID_VALUERANK,
+    OPCUA_ATTRIBUTEID_ACCESSLEVEL
+  };
+
+  ctx->job = job;
+  ctx->n = 0;
+  ctx->vars = calloc(params->batch, sizeof(size_t));
+  for (; *pos < job->nvars && ctx->n < params->batch; (*pos)++)
+  {
+    discovered_var *var = &job->vars[*pos];
+    variable_info *info = opcua_map_get(&job->server->variables, var->key);
+
+    if (info && info->expires > job->now)
+    {
+      var->info = info;
+      continue;
+    }
+    for (uint32_t a = 0; a < OPCUA_VARIABLE_ATTRS; a++)
+    {
+      UA_ReadValueId *id = &ids[ctx->n * OPCUA_VARIABLE_ATTRS + a];
+      UA_ReadValueId_init(id);
+      id->nodeId = *var->nodeId;
+      id->attributeId = attrs[a];
+    }
+    ctx->vars[ctx->n++] = *pos;
+  }
+
+  retval = UA_STATUSCODE_BADNOTHINGTODO;
+  if (ctx->n)
+  {
+    UA_ReadRequest_init(&request);
+    request.nodesToRead = ids;
+    request.nodesToReadSize = ctx->n * OPCUA_VARIABLE_ATTRS;
+    request.timestampsToReturn = UA_TIMESTAMPSTORETURN_NEITHER;
+    retval = __UA_Client_AsyncService(job->client, &request,
+      &UA_TYPES[UA_TYPES_READREQUEST], read_complete,
+      &UA_TYPES[UA_TYPES_READRESPONSE], ctx, NULL);
+    request_sent(job, retval, "Read");
+  }
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    free(ctx->vars);
+    free(ctx);
+  }
+  free(ids);
+}
+
+static void read_variables(discovery_job *job)
+{
+  size_t pos = 0;
+
+  while (!job->failed && (pos < job->nvars || job->inflight))
+  {
+    while (!job->failed && job->inflight < job->params->inflight &&
+      pos < job->nvars)
+    {
+      send_read(job, &pos);
+    }
+    if (job->inflight)
+      discovery_wait(job);
+  }
+}
+
+/*
+ * Forget what was browsed of a server which has restarted since, as its
+ * address space may have changed.
+ */
+static discovered_server *discovered_server_get(opcua_discovery *disc,
+  discovery_job *job, const char *endpoint)
+{
+  discovered_server *server = opcua_map_get(&disc->servers, endpoint);
+  UA_DateTime startTime = 0;
+  UA_Variant value;
+
+  UA_Variant_init(&value);
+  if (UA_Client_readValueAttribute(job->client,
+    UA_NODEID_NUMERIC(0, OPCUA_NS0ID_STARTTIME), &value) ==
+    UA_STATUSCODE_GOOD && value.type == &UA_TYPES[UA_TYPES_DATETIME])
+  {
+    startTime = *(UA_DateTime *)value.data;
+  }
+  UA_Variant_deleteMembers(&value);
+
+  if (server && (startTime == 0 || startTime != server->startTime))
+  {
+    iot_log_info(job->lc, "Server at %s has restarted, browsing it afresh",
+      endpoint);
+    free_server(opcua_map_remove(&disc->servers, endpoint));
+    server = NULL;
+  }
+  if (!server)
+  {
+    server = malloc(sizeof(discovered_server));
+    opcua_map_init(&server->nodes);
+    opcua_map_init(&server->variables);
+    opcua_map_put(&disc->servers, endpoint, server);
+  }
+  server->startTime = startTime;
+  return server;
+}
+
+/* Characters other than these are replaced in generated names */
+static void sanitize(char *str)
+{
+  for (; *str; str++)
+  {
+    if (!isalnum((unsigned char)*str) && *str != '_' && *str != '-' &&
+      *str != '.')
+    {
+      *str = '_';
+    }
+  }
+}
+
+/* Write a string as a double quoted YAML scalar */
+static void yaml_quoted(FILE *f, const char *str, size_t len)
+{
+  fputc('"', f);
+  for (size_t i = 0; i < len; i++)
+  {
+    unsigned char c = (unsigned char)str[i];
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\x%02x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+static void yaml_string(FILE *f, const char *str)
+{
+  yaml_quoted(f, str, strlen(str));
+}
+
+/* Write the nodeID, nsIndex and IDType attributes of a node */
+static void write_node_attrs(FILE *f, const UA_NodeId *id)
+{
+  const UA_String *s = &id->identifier.string;
+
+  fputs("nodeID: ", f);
+  switch (id->identifierType)
+  {
+    case UA_NODEIDTYPE_NUMERIC:
+      fprintf(f, "\"%u\", nsIndex: \"%u\", IDType: \"NUMERIC\"",
+        id->identifier.numeric, id->namespaceIndex);
+      break;
+    case UA_NODEIDTYPE_STRING:
+      yaml_quoted(f, (const char *)s->data, s->length);
+      fprintf(f, ", nsIndex: \"%u\", IDType: \"STRING\"", id->namespaceIndex);
+      break;
+    case UA_NODEIDTYPE_GUID:
+    {
+      const UA_Guid *g = &id->identifier.guid;
+      fprintf(f, "\"" UA_PRINTF_GUID_FORMAT "\"", g->data1, g->data2,
+        g->data3, g->data4[0], g->data4[1], g->data4[2], g->data4[3],
+        g->data4[4], g->data4[5], g->data4[6], g->data4[7]);
+      fprintf(f, ", nsIndex: \"%u\", IDType: \"GUID\"", id->namespaceIndex);
+      break;
+    }
+    default:
+      yaml_quoted(f, (const char *)s->data, s->length);
+      fprintf(f, ", nsIndex: \"%u\", IDType: \"BYTESTRING\"",
+        id->namespaceIndex);
+      break;
+  }
+}
+
+/* Byte string ids are given as text in profiles, so must be printable */
+static bool nodeid_writable(const UA_NodeId *id)
+{
+  if (id->identifierType != UA_NODEIDTYPE_BYTESTRING)
+    return true;
+  for (size_t i = 0; i < id->identifier.byteString.length; i++)
+  {
+    if (!isprint(id->identifier.byteString.data[i]))
+      return false;
+  }
+  return true;
+}
+
+/* Write a deviceResource for a variable, if its type is supported */
+static bool write_resource(FILE *f, const discovered_var *var,
+  opcua_map *names)
+{
+  const variable_info *info = var->info;
+  const char *type = NULL;
+  const char *arrayType = NULL;
+  const char *access;
+  char *name;
+  size_t len;
+
+  if (!info || !nodeid_writable(var->nodeId))
+    return false;
+  for (size_t i = 0;
+    i < sizeof(opcua_discovery_types) / sizeof(opcua_discovery_types[0]); i++)
+  {
+    if (opcua_discovery_types[i].id == info->dataType)
+    {
+      type = opcua_discovery_types[i].edgexType;
+      arrayType = opcua_discovery_types[i].arrayType;
+      break;
+    }
+  }
+  if (!type || (info->valueRank > 0 && !arrayType))
+    return false;
+  if (info->valueRank > 0)
+    type = "Binary";
+  else if (info->valueRank != -1)
+    return false;
+
+  switch (info->accessLevel &
+    (OPCUA_ACCESSLEVEL_READ | OPCUA_ACCESSLEVEL_WRITE))
+  {
+    case OPCUA_ACCESSLEVEL_READ: access = "R"; break;
+    case OPCUA_ACCESSLEVEL_WRITE: access = "W"; break;
+    case OPCUA_ACCESSLEVEL_READ | OPCUA_ACCESSLEVEL_WRITE:
+      access = "RW";
+      break;
+    default: return false;
+  }
+
+  /* Browse names need not be unique, suffix any repeats */
+  len = strlen(var->name);
+  name = malloc(len + 16);
+  strcpy(name, *var->name ? var->name : "Node");
+  sanitize(name);
+  for (uint32_t n = 2; opcua_map_get(names, name); n++)
+  {
+    strcpy(name, *var->name ? var->name : "Node");
+    sanitize(name);
+    sprintf(name + strlen(name), "_%u", n);
+  }
+  opcua_map_put(names, name, names);
+
+  fputs("  - name: ", f);
+  yaml_string(f, name);
+  fputs("\n    description: ", f);
+  yaml_string(f, var->key);
+  fputs("\n    attributes:\n      { ", f);
+  write_node_attrs(f, var->nodeId);
+  if (info->valueRank > 0)
+    fprintf(f, ", arrayType: \"%s\"", arrayType);
+  fputs(" }\n    properties:\n      value:\n", f);
+  fprintf(f, "        { type: \"%s\", readWrite: \"%s\" }\n", type, access);
+  fputs("      units:\n", f);
+  fputs("        { type: \"String\", readWrite: \"R\", defaultValue: \"\" }\n",
+    f);
+  free(name);
+  return true;
+}
+
+/*
+ * Write the profile of a server, replacing any earlier one once it is
+ * complete. Returns the number of deviceResources written.
+ */
+static uint32_t write_profile(discovery_job *job, const char *endpoint)
+{
+  char *name = strdup(endpoint);
+  char *path;
+  char *tmp;
+  FILE *f;
+  opcua_map names;
+  uint32_t count = 0;
+
+  sanitize(name);
+  path = malloc(strlen(job->params->dir) + strlen(name) + 8);
+  sprintf(path, "%s/%s.yaml", job->params->dir, name);
+  tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+
+  f = fopen(tmp, "w");
+  if (!f)
+  {
+    iot_log_error(job->lc, "Unable to write discovered profile %s", tmp);
+    goto done;
+  }
+  fprintf(f, "name: \"Discovered - %s\"\n", name);
+  fputs("manufacturer: \"OPC-UA\"\nmodel: \"Discovered\"\n", f);
+  fputs("description: ", f);
+  yaml_string(f, endpoint);
+  fputs("\nlabels:\n  - \"opc-ua\"\n  - \"discovered\"\n\n", f);
+  fputs("deviceResources:\n", f);
+
+  opcua_map_init(&names);
+  for (size_t i = 0; i < job->nvars; i++)
+  {
+    if (write_resource(f, &job->vars[i], &names))
+      count++;
+  }
+  opcua_map_fini(&names, NULL);
+
+  if (fclose(f) != 0 || count == 0 || rename(tmp, path) != 0)
+  {
+    if (count)
+      iot_log_error(job->lc, "Unable to write discovered profile %s", path);
+    remove(tmp);
+    count = 0;
+  }
+
+done:
+  free(tmp);
+  free(path);
+  free(name);
+  return count;
+}
+
+static void free_job(discovery_job *job)
+{
+  for (size_t i = job->head; i < job->tail; i++)
+    UA_NodeId_deleteMembers(&job->frontier[i].nodeId);
+  free(job->frontier);
+  for (size_t i = 0; i < job->nnext; i++)
+    UA_ByteString_deleteMembers(&job->next[i].point);
+  free(job->next);
+  for (size_t i = 0; i < job->nvars; i++)
+    free(job->vars[i].key);
+  free(job->vars);
+  opcua_map_fini(&job->seen, NULL);
+}
+
+uint32_t opcua_discover_endpoint(opcua_discovery *disc, iot_logger_t *lc,
+  const opcua_discovery_params *params, const char *endpoint)
+{
+  discovery_job job;
+  UA_StatusCode retval;
+  uint32_t count = 0;
+  uint64_t start = discovery_now();
+
+  memset(&job, 0, sizeof(discovery_job));
+  job.lc = lc;
+  job.params = params;
+  job.now = start;
+  opcua_map_init(&job.seen);
+
+  job.client = UA_Client_new(UA_ClientConfig_default);
+  retval = UA_Client_connect(job.client, endpoint);
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    iot_log_error(lc, "Discovery failed to connect to %s. Status Code: %s",
+      endpoint, UA_StatusCode_name(retval));
+    UA_Client_delete(job.client);
+    free_job(&job);
+    return 0;
+  }
+
+  pthread_mutex_lock(&disc->mutex);
+  job.server = discovered_server_get(disc, &job, endpoint);
+  browse_address_space(&job);
+  if (!job.failed)
+    read_variables(&job);
+
+  /* Outstanding requests are completed, with an error, by the disconnect */
+  UA_Client_disconnect(job.client);
+  UA_Client_delete(job.client);
+
+  if (!job.failed)
+  {
+    count = write_profile(&job, endpoint);
+    iot_log_info(lc, "Discovered %u resource(s) of %zu variable(s) at %s "
+      "in %" PRIu64 "ms with %u request(s)", count, job.nvars, endpoint,
+      discovery_now() - start, job.requests);
+  }
+  pthread_mutex_unlock(&disc->mutex);
+
+  free_job(&job);
+  return count;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_DISCOVERY_H_
+#define _OPCUA_DISCOVERY_H_
+
+#include <pthread.h>
+#include "edgex/devsdk.h"
+#include "open62541.h"
+#include "opcua_map.h"
+
+/* How an address space is browsed, and where its profile is written */
+typedef struct opcua_discovery_params
+{
+  UA_NodeId root;
+  /* Levels below the root to report, 0 for no limit */
+  uint32_t depth;
+  /* Namespaces of the nodes reported and followed, all if there are none */
+  const uint16_t *namespaces;
+  uint32_t nnamespaces;
+  /* Nodes per Browse or BrowseNext request, and requests in flight */
+  uint32_t batch;
+  uint32_t inflight;
+  /* Time in milliseconds to wait for a response */
+  uint32_t timeout;
+  /* Time in milliseconds for which a browsed node is not browsed again */
+  uint32_t ttl;
+  const char *dir;
+} opcua_discovery_params;
+
+/*
+ * What has been browsed of each server, keyed by endpoint, kept between
+ * discovery runs so that only expired parts of an address space are browsed
+ * again.
+ */
+typedef struct opcua_discovery
+{
+  pthread_mutex_t mutex;
+  opcua_map servers;
+} opcua_discovery;
+
+extern void opcua_discovery_init(opcua_discovery *disc);
+extern void opcua_discovery_fini(opcua_discovery *disc);
+
+/*
+ * Parse a node id in its standard string form, "ns=<index>;i=<number>" or
+ * "ns=<index>;s=<string>", where the namespace may be omitted for 0.
+ */
+extern bool opcua_parse_nodeid_string(const char *str, UA_NodeId *nodeId);
+
+/*
+ * Browse the address space of the server at an endpoint from the root node,
+ * and write a device profile with a deviceResource for each supported
+ * variable found. Returns the number of deviceResources written.
+ */
+extern uint32_t opcua_discover_endpoint(opcua_discovery *disc,
+  iot_logger_t *lc, const opcua_discovery_params *params,
+  const char *endpoint);
+
+#endif
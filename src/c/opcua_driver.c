@@ -0,0 +1,4143 @@
+/*
+ * Copyright (c) 2018
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_driver.h"
+#include "open62541.h"
+#include "opcua_map.h"
+#include "opcua_arena.h"
+#include "opcua_metrics.h"
+#include "opcua_resource.h"
+#include "opcua_convert.h"
+#include "opcua_wheel.h"
+#include "opcua_discovery.h"
+
+#include <inttypes.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define PROTOCOL "opc.tcp://"
+
+#define DEFAULT_LOOP_THREADS 1
+#define DEFAULT_LOOP_INTERVAL 200
+#define LOOP_MAX_EVENTS 64
+#define DEFAULT_NOTIFY_WINDOW 0
+#define DEFAULT_NOTIFY_BATCH 1000
+#define DEFAULT_REQUEST_TIMEOUT 5000
+#define DEFAULT_RECONNECT_DELAY 500
+#define DEFAULT_RECONNECT_MAX_DELAY 30000
+#define DEFAULT_CONNECT_WAIT 0
+#define DEFAULT_METRICS_INTERVAL 0
+#define DEFAULT_METRICS_PORT 0
+#define DEFAULT_METRICS_ADDRESS "127.0.0.1"
+#define DEFAULT_DEVICE_SCAN 30
+#define DEFAULT_POLL_TICK 100
+#define DEFAULT_MONITOR_BATCH 500
+#define DEFAULT_DISCOVERY_DEPTH 0
+#define DEFAULT_DISCOVERY_BATCH 100
+#define DEFAULT_DISCOVERY_REQUESTS 4
+#define DEFAULT_DISCOVERY_CACHE_TIME 300
+/* Slots of the polling wheel, one turn of which is this many ticks */
+#define OPCUA_WHEEL_SLOTS 512
+/* Requests of up to this many resources are built on the stack */
+#define OPCUA_STACK_NODES 16
+
+/*
+ * A monitored item. It is passed to the client as the monitored item context
+ * so notifications can be mapped to their resource without any searching.
+ */
+typedef struct subscription_info
+{
+  uint32_t monId;
+  /* Assigned by the client when the item is created */
+  uint32_t clientHandle;
+  /* Source timestamp of the latest change, to skip republished repeats */
+  UA_DateTime lastSource;
+  char *devname;
+  char *name;
+  struct opcua_device *device;
+  /* The resource, holding the last value notified. A reference is held */
+  opcua_resource *res;
+  struct opcua_subscription *sub;
+  struct notify_group *group;
+  uint32_t group_index;
+  struct subscription_info *next;
+} subscription_info;
+
+/*
+ * A device command made up only of monitored resources. Changes to its
+ * resources are posted together as a single event holding the latest value
+ * of each of them.
+ */
+typedef struct notify_group
+{
+  char *command;
+  char *devname;
+  uint32_t nres;
+  const char **names;
+  edgex_device_commandresult *last;
+  /* Buffers holding the string or binary values of last, kept for reuse */
+  uint8_t **buffers;
+  size_t *sizes;
+  bool *seen;
+  uint32_t nseen;
+  bool *dirty;
+  bool queued;
+  struct notify_group *next_dirty;
+  struct notify_group *next;
+} notify_group;
+
+/* A subscription owned by a connection, used as the subscription context */
+typedef struct opcua_subscription
+{
+  uint32_t subId;
+  struct opcua_connection *conn;
+  struct opcua_device *device;
+  subscription_info *items;
+  /* The items keyed by client handle, as notification messages give them */
+  opcua_map handles;
+  /* Requested publishing interval and priority, to recreate it with */
+  double interval;
+  UA_Byte priority;
+  /*
+   * Set once the server has moved the subscription to a later session. The
+   * client serving that session did not create it, so doesn't know it.
+   */
+  bool transferred;
+  notify_group *groups;
+  struct opcua_subscription *next;
+} opcua_subscription;
+
+/* A converted data change waiting to be posted */
+typedef struct opcua_notification
+{
+  subscription_info *item;
+  edgex_device_commandresult result;
+  /* Monotonic time of receipt, in microseconds */
+  uint64_t received;
+} opcua_notification;
+
+typedef struct client_context
+{
+  void *driver;
+  struct opcua_connection *conn;
+} client_context;
+
+/* An EdgeX device served by a connection */
+typedef struct opcua_device
+{
+  char *devname;
+  struct opcua_connection *conn;
+  opcua_latency latency;
+  /*
+   * Set if the device's profile changed while the session was down, so its
+   * subscriptions are recreated rather than transferred. Guarded by the
+   * connection mutex.
+   */
+  bool resubscribe;
+  struct opcua_device *next;
+} opcua_device;
+
+/*
+ * Session state of a connection. A new connection is CONNECTING until its
+ * first connect completes; one whose session is lost is DOWN until the
+ * reconnect supervisor takes it up.
+ */
+typedef enum opcua_conn_state
+{
+  OPCUA_CONN_UP,
+  OPCUA_CONN_DOWN,
+  OPCUA_CONN_CONNECTING,
+  OPCUA_CONN_RECONNECTING
+} opcua_conn_state;
+
+typedef struct opcua_connection
+{
+  struct opcua_driver *driver;
+  UA_Client *client;
+  char *addr_id;
+  char *endpoint;
+  pthread_mutex_t mutex;
+  /* Guarded by state_mutex */
+  int reconnect_count;
+  /* Devices sharing the session, guarded by mutex */
+  opcua_device *devices;
+  /* Guards changes of the session state, signalled when it changes */
+  pthread_mutex_t state_mutex;
+  pthread_cond_t state_cond;
+  /* An opcua_conn_state, which may be read without state_mutex */
+  atomic_int state;
+  uint32_t backoff;
+  uint64_t retry_at;
+  /* Guards the subscriptions, and is held while their changes are posted */
+  pthread_mutex_t subs_mutex;
+  opcua_subscription *subs;
+  /*
+   * Subscriptions dropped by the client when its session was lost, kept
+   * until the session is back so that their missed changes can be recovered
+   */
+  opcua_subscription *detached;
+  /*
+   * Notifications not yet posted, guarded by mutex. Their strings are held
+   * in the arena, which is swapped for the spare (guarded by subs_mutex)
+   * while a batch is posted.
+   */
+  opcua_notification *pending;
+  uint32_t npending;
+  uint32_t pending_size;
+  uint64_t pending_since;
+  opcua_arena *arena;
+  opcua_arena *spare;
+  opcua_arena arenas[2];
+  /*
+   * Publish requests outstanding on the session, and the most to keep
+   * outstanding, with the acknowledgements the next one carries. Guarded
+   * by mutex.
+   */
+  uint16_t publishing;
+  uint16_t publish_max;
+  UA_SubscriptionAcknowledgement *acks;
+  uint32_t nacks;
+  uint32_t acks_size;
+  /* Client socket, recorded each time the client (re)connects */
+  atomic_int sockfd;
+  atomic_uint sock_gen;
+  /* The loop thread servicing the connection, set once */
+  struct opcua_loop *loop;
+  /* Socket registered with the loop's epoll set, guarded by mutex */
+  int polled_fd;
+  unsigned polled_gen;
+  /* Whether the socket is armed, it is disarmed by each event delivered */
+  atomic_bool armed;
+  /* Set when the loop found mutex taken, so that its holder wakes the loop */
+  atomic_bool deferred;
+  /* Owned by the loop thread */
+  uint64_t next_run;
+} opcua_connection;
+
+/* A thread servicing the clients of a shard of the connections */
+typedef struct opcua_loop
+{
+  pthread_t thread;
+  int epfd;
+  int wakefd;
+  pthread_mutex_t mutex;
+  opcua_connection **conns;
+  uint32_t length;
+  uint32_t capacity;
+  /* Connections due a run, copied out of conns by the thread */
+  opcua_connection **due;
+  uint32_t due_size;
+  struct opcua_driver *driver;
+} opcua_loop;
+
+/* A device command made up only of resources of a device's part of a group */
+typedef struct poll_command
+{
+  char *command;
+  uint32_t nres;
+  /* Index in the device's part of the group of each of its resources */
+  uint32_t *index;
+  struct poll_command *next;
+} poll_command;
+
+/*
+ * The part of a poll group belonging to one device: the nres nodes of the
+ * group's read from start.
+ */
+typedef struct poll_device
+{
+  char *devname;
+  uint32_t start;
+  uint32_t nres;
+  /* Resources posted as part of a command */
+  bool *grouped;
+  poll_command *commands;
+} poll_device;
+
+/*
+ * The polled resources of a connection's devices which share an interval,
+ * read with a single request each time they fall due, and posted device by
+ * device. The wheel entry comes first, so an expired entry is its group.
+ */
+typedef struct opcua_poll_group
+{
+  opcua_wheel_entry entry;
+  struct opcua_connection *conn;
+  uint32_t interval;
+  uint32_t ticks;
+  uint32_t nres;
+  char **names;
+  /* References to the resources, which the node ids belong to */
+  opcua_resource **res;
+  UA_ReadValueId *ids;
+  poll_device *devices;
+  uint32_t ndevices;
+  /* Set while a read is outstanding, whose response is stored here */
+  atomic_bool in_flight;
+  UA_ReadResponse response;
+  /* Set once the group is replaced, after which its readings are dropped */
+  atomic_bool retired;
+  /* Owned by the poller thread */
+  bool due;
+  struct opcua_poll_group *next_due;
+  /* Guarded by the poller mutex */
+  bool scheduled;
+  struct opcua_poll_group *next_done;
+  struct opcua_poll_group *next;
+} opcua_poll_group;
+
+/*
+ * Thread reading poll groups as they fall due on a timer wheel, and posting
+ * the readings once their responses arrive.
+ */
+typedef struct opcua_poller
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool running;
+  opcua_wheel wheel;
+  uint32_t tick;
+  uint64_t next_tick;
+  /* All groups, and those whose reads have completed */
+  opcua_poll_group *groups;
+  opcua_poll_group *done;
+  /*
+   * Groups replaced by a rebuild, kept until they are neither scheduled nor
+   * being read
+   */
+  opcua_poll_group *retired;
+  /* Serialises the building of the connections' groups */
+  pthread_mutex_t setup_mutex;
+  /* Holds the strings of the readings being posted, owned by the thread */
+  opcua_arena arena;
+} opcua_poller;
+
+/* Counters and timings of the driver, exported on MetricsPort */
+typedef struct opcua_driver_metrics
+{
+  atomic_uint_fast64_t gets;
+  atomic_uint_fast64_t get_failures;
+  atomic_uint_fast64_t puts;
+  atomic_uint_fast64_t put_failures;
+  /* Requests refused because their connection was down */
+  atomic_uint_fast64_t unavailable;
+  /* Readings answered from the last notified value */
+  atomic_uint_fast64_t cached_reads;
+  atomic_uint_fast64_t notifications;
+  atomic_uint_fast64_t notifications_posted;
+  /* Changes fetched with Republish after a reconnect */
+  atomic_uint_fast64_t notifications_recovered;
+  /* Changes received but not yet posted */
+  atomic_int_fast64_t notifications_queued;
+  atomic_uint_fast64_t reconnects;
+  atomic_uint_fast64_t reconnect_failures;
+  atomic_uint_fast64_t loop_runs;
+  atomic_uint_fast64_t polls;
+  atomic_uint_fast64_t poll_failures;
+  /* Polls not made as the connection was down or the last was outstanding */
+  atomic_uint_fast64_t polls_skipped;
+  atomic_uint_fast64_t poll_readings;
+  opcua_histogram get_time;
+  opcua_histogram put_time;
+  opcua_histogram loop_time;
+  /* Time spent waiting for a connection's mutex to send a request */
+  opcua_histogram lock_wait;
+  /* When the latencies were last logged, by the caller of log_metrics */
+  uint64_t last_logged;
+} opcua_driver_metrics;
+
+struct opcua_driver
+{
+  iot_logger_t *lc;
+  opcua_service_ops ops;
+  pthread_mutex_t mutex;
+  /*
+   * Connections keyed by endpoint URL, and the devices using them keyed by
+   * name. Only removed when the service stops.
+   */
+  pthread_rwlock_t conn_lock;
+  opcua_map connections;
+  opcua_map devices;
+  opcua_loop *loops;
+  uint32_t nloops;
+  uint32_t next_loop;
+  uint32_t loop_interval;
+  atomic_bool loops_running;
+  uint32_t notify_window;
+  uint32_t notify_batch;
+  /* Monitored items created by each CreateMonitoredItems request */
+  uint32_t monitor_batch;
+  uint32_t request_timeout;
+  /*
+   * Background reconnection of lost sessions, and resubscription of the
+   * devices whose profiles have changed
+   */
+  pthread_t supervisor;
+  pthread_mutex_t sup_mutex;
+  pthread_cond_t sup_cond;
+  bool sup_running;
+  /* Changes recorded by the resource cache which the supervisor has seen */
+  atomic_uint changes_seen;
+  /* Seconds between scans of the service's devices, 0 for none */
+  uint32_t device_scan;
+  uint32_t reconnect_delay;
+  uint32_t reconnect_max_delay;
+  uint32_t connect_wait;
+  uint32_t metrics_interval;
+  opcua_driver_metrics metrics;
+  opcua_exporter *exporter;
+  opcua_poller poller;
+  /* Endpoints browsed by discovery besides those of the connections */
+  char *discovery_endpoints;
+  uint16_t *discovery_namespaces;
+  opcua_discovery_params discovery_params;
+  opcua_discovery discovery;
+  opcua_resource_cache resources;
+};
+
+static void opcua_collect_metrics(opcua_metrics_buf *buf, void *arg);
+static void opcua_loop_watch(opcua_connection *conn, int fd, unsigned gen);
+static void setup_connection_polling(opcua_driver *uadr,
+  opcua_connection *conn);
+static opcua_connection *find_opcua_connection(opcua_driver *uadr,
+  const char *devname, edgex_protocols *protocol);
+
+/* OPCUA General */
+
+static uint64_t opcua_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t opcua_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Absolute CLOCK_REALTIME time for a condition wait of ms milliseconds */
+static void opcua_deadline(struct timespec *ts, uint32_t ms)
+{
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000)
+  {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static void opcua_loop_wake(opcua_loop *loop)
+{
+  uint64_t one = 1;
+  (void)write(loop->wakefd, &one, sizeof(one));
+}
+
+/*
+ * Release a connection's mutex. If its loop thread passed the connection by
+ * while it was held, the loop is woken to service it, as its socket is not
+ * watched again until then.
+ */
+static void opcua_conn_unlock(opcua_connection *conn)
+{
+  pthread_mutex_unlock(&conn->mutex);
+  if (atomic_load(&conn->deferred))
+    opcua_loop_wake(conn->loop);
+}
+
+static void free_subs(subscription_info *sub)
+{
+  subscription_info *tmp = sub, *tmp2;
+
+  while (tmp)
+  {
+    tmp2 = tmp->next;
+    opcua_resource_release(tmp->res);
+    free(tmp->name);
+    free(tmp->devname);
+    free(tmp);
+    tmp = tmp2;
+  }
+  return;
+}
+
+static void free_groups(notify_group *group)
+{
+  notify_group *next;
+
+  while (group)
+  {
+    next = group->next;
+    for (uint32_t i = 0; i < group->nres; i++)
+    {
+      free(group->buffers[i]);
+    }
+    free(group->command);
+    free(group->devname);
+    free(group->names);
+    free(group->last);
+    free(group->buffers);
+    free(group->sizes);
+    free(group->seen);
+    free(group->dirty);
+    free(group);
+    group = next;
+  }
+}
+
+/*
+ * Unlink a subscription from its connection and free it with its items.
+ * Taking subs_mutex waits for any post of its changes to complete; changes
+ * still pending are dropped. Called with the connection mutex held, or
+ * when no other thread can be using the connection.
+ */
+static void free_subscription(opcua_subscription *sub)
+{
+  opcua_connection *conn = sub->conn;
+  opcua_subscription **pos;
+  uint32_t kept = 0;
+
+  pthread_mutex_lock(&conn->subs_mutex);
+  for (pos = &conn->subs; *pos && *pos != sub; pos = &(*pos)->next);
+  if (!*pos)
+    for (pos = &conn->detached; *pos && *pos != sub; pos = &(*pos)->next);
+  if (*pos)
+    *pos = sub->next;
+
+  /* Drop the sub's queued changes, their strings belong to the arena */
+  for (uint32_t i = 0; i < conn->npending; i++)
+  {
+    if (conn->pending[i].item->sub != sub)
+      conn->pending[kept++] = conn->pending[i];
+  }
+  atomic_fetch_sub(&conn->driver->metrics.notifications_queued,
+    conn->npending - kept);
+  conn->npending = kept;
+  pthread_mutex_unlock(&conn->subs_mutex);
+
+  /* The sub's items are no longer notified of changes */
+  for (subscription_info *item = sub->items; item; item = item->next)
+    opcua_last_value_invalidate(&item->res->last);
+
+  free_groups(sub->groups);
+  free_subs(sub->items);
+  opcua_map_fini(&sub->handles, NULL);
+  free(sub);
+}
+
+/*
+ * Called as the client drops a subscription, which it does for all of them
+ * when the session is lost or the client is deleted. The subscription is
+ * set aside until the session is back, or the connection is freed; changes
+ * already queued for it are still posted. A client replaced on reconnect
+ * is deleted after its subscriptions have been set aside and transferred,
+ * so its calls are ignored.
+ */
+static void deleteSubscriptionCallback(UA_Client *client,
+  UA_UInt32 subscriptionId, void *subscriptionContext)
+{
+  opcua_subscription *sub = (opcua_subscription *)subscriptionContext;
+  opcua_connection *conn;
+  opcua_subscription **pos;
+
+  if (!sub || client != sub->conn->client)
+    return;
+  conn = sub->conn;
+  pthread_mutex_lock(&conn->subs_mutex);
+  for (pos = &conn->subs; *pos && *pos != sub; pos = &(*pos)->next);
+  if (*pos)
+  {
+    *pos = sub->next;
+    sub->next = conn->detached;
+    conn->detached = sub;
+  }
+  pthread_mutex_unlock(&conn->subs_mutex);
+
+  /* The sub's items are no longer notified of changes */
+  for (subscription_info *item = sub->items; item; item = item->next)
+    opcua_last_value_invalidate(&item->res->last);
+}
+
+/*
+ * The origin of a reading, in milliseconds. Taken from the device's
+ * timestamp, or failing that the server's.
+ */
+static uint64_t opcua_origin(const UA_DataValue *value)
+{
+  if (value->hasSourceTimestamp)
+  {
+    return (uint64_t)((value->sourceTimestamp - UA_DATETIME_UNIX_EPOCH) /
+      UA_DATETIME_MSEC);
+  }
+  if (value->hasServerTimestamp)
+  {
+    return (uint64_t)((value->serverTimestamp - UA_DATETIME_UNIX_EPOCH) /
+      UA_DATETIME_MSEC);
+  }
+  return 0;
+}
+
+/* Generic handler to post readings from monitored items */
+static void subscription_handler(UA_Client *client, UA_UInt32 subId,
+  void *subContext, UA_UInt32 monId, void *monContext, UA_DataValue *value)
+{
+  client_context *clientContext;
+  opcua_driver *uadr;
+  opcua_connection *conn;
+  subscription_info *item = (subscription_info *)monContext;
+  opcua_notification *notification;
+
+  clientContext = (client_context *)UA_Client_getContext(client);
+  if (!clientContext)
+    return;
+
+  uadr = clientContext->driver;
+  if (!item)
+  {
+    iot_log_error(uadr->lc, "No subscriptions id match");
+    return;
+  }
+  if (!item->name || !item->devname)
+  {
+    iot_log_error(uadr->lc, "No subscription name found");
+    return;
+  }
+
+  /*
+   * The client is run with the connection mutex held. Queue the change, it
+   * is posted with the rest of the publish cycle once the client returns.
+   */
+  conn = item->sub->conn;
+  if (conn->npending == conn->pending_size)
+  {
+    conn->pending_size = conn->pending_size ? conn->pending_size * 2 : 64;
+    conn->pending = realloc(conn->pending,
+      conn->pending_size * sizeof(opcua_notification));
+  }
+  if (conn->npending == 0)
+    conn->pending_since = opcua_now_ms();
+  notification = &conn->pending[conn->npending++];
+  notification->item = item;
+  notification->result = opcua_to_edgex(&value->value, uadr->lc, conn->arena);
+  notification->received = opcua_now_us();
+  atomic_fetch_add(&uadr->metrics.notifications, 1);
+  atomic_fetch_add(&uadr->metrics.notifications_queued, 1);
+
+  notification->result.origin = opcua_origin(value);
+  if (value->hasSourceTimestamp)
+    item->lastSource = value->sourceTimestamp;
+
+  /* Keep the value to answer GETs with, if the resource allows it */
+  if (atomic_load(&item->res->maxAge))
+  {
+    if (value->hasValue && value->value.type &&
+      (!value->hasStatus || value->status == UA_STATUSCODE_GOOD))
+    {
+      opcua_last_value_store(&item->res->last, &notification->result,
+        notification->received);
+    }
+    else
+    {
+      opcua_last_value_invalidate(&item->res->last);
+    }
+  }
+
+  if (value->hasServerTimestamp)
+  {
+    opcua_latency *latency = &item->device->latency;
+    if (value->hasSourceTimestamp)
+    {
+      opcua_histogram_record(&latency->source_server,
+        (value->serverTimestamp - value->sourceTimestamp) / UA_DATETIME_USEC);
+    }
+    opcua_histogram_record(&latency->server_receive,
+      (UA_DateTime_now() - value->serverTimestamp) / UA_DATETIME_USEC);
+  }
+}
+
+/*
+ * Keep a group's latest value, copying any string or binary data into the
+ * group's buffer for the resource.
+ */
+static void store_group_value(notify_group *group, uint32_t i,
+  const edgex_device_commandresult *result)
+{
+  const void *data = NULL;
+  size_t len = 0;
+
+  group->last[i] = *result;
+  if (result->type == String)
+  {
+    data = result->value.string_result;
+    len = strlen(result->value.string_result) + 1;
+  }
+  else if (result->type == Binary)
+  {
+    data = result->value.binary_result.bytes;
+    len = result->value.binary_result.size;
+  }
+  if (!data)
+    return;
+
+  if (len > group->sizes[i])
+  {
+    group->buffers[i] = realloc(group->buffers[i], len);
+    group->sizes[i] = len;
+  }
+  memcpy(group->buffers[i], data, len);
+  if (result->type == String)
+    group->last[i].value.string_result = (char *)group->buffers[i];
+  else
+    group->last[i].value.binary_result.bytes = group->buffers[i];
+}
+
+/* Post the changed resources of a group, as one event if it is complete */
+static void post_group(opcua_driver *uadr, notify_group *group)
+{
+  if (group->nseen == group->nres)
+  {
+    uadr->ops.post_readings(uadr->ops.ctx, group->devname, group->command,
+      group->nres, group->last);
+  }
+  else
+  {
+    for (uint32_t i = 0; i < group->nres; i++)
+    {
+      if (group->dirty[i])
+        uadr->ops.post_readings(uadr->ops.ctx, group->devname,
+          group->names[i], 1, &group->last[i]);
+    }
+  }
+  memset(group->dirty, 0, group->nres * sizeof(bool));
+}
+
+/*
+ * Post a batch of changes. Changes to resources belonging to a group are
+ * coalesced into one event per group; a group is posted early if one of its
+ * resources changes twice, so that no value is lost. Called with the
+ * connection's subs_mutex held.
+ */
+static void post_notifications(opcua_driver *uadr, opcua_notification *batch,
+  uint32_t count)
+{
+  notify_group *dirty = NULL;
+  uint64_t now;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    subscription_info *item = batch[i].item;
+    notify_group *group = item->group;
+
+    if (!group)
+    {
+      uadr->ops.post_readings(uadr->ops.ctx, item->devname, item->name, 1,
+        &batch[i].result);
+      opcua_histogram_record(&item->device->latency.receive_post,
+        (int64_t)(opcua_now_us() - batch[i].received));
+      continue;
+    }
+
+    if (group->dirty[item->group_index])
+      post_group(uadr, group);
+    store_group_value(group, item->group_index, &batch[i].result);
+    if (!group->seen[item->group_index])
+    {
+      group->seen[item->group_index] = true;
+      group->nseen++;
+    }
+    group->dirty[item->group_index] = true;
+    if (!group->queued)
+    {
+      group->queued = true;
+      group->next_dirty = dirty;
+      dirty = group;
+    }
+  }
+
+  for (; dirty; dirty = dirty->next_dirty)
+  {
+    post_group(uadr, dirty);
+    dirty->queued = false;
+  }
+
+  now = opcua_now_us();
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (batch[i].item->group)
+    {
+      opcua_histogram_record(&batch[i].item->device->latency.receive_post,
+        (int64_t)(now - batch[i].received));
+    }
+  }
+}
+
+/*
+ * Post the connection's pending changes, unless they are being held back to
+ * be batched with later ones. Called with the connection mutex held, which
+ * is released before posting; subs_mutex is taken first so that the items
+ * can't be freed while the batch is in flight.
+ */
+static void flush_notifications(opcua_driver *uadr, opcua_connection *conn,
+  uint64_t now)
+{
+  opcua_notification *batch = conn->pending;
+  uint32_t count = conn->npending;
+  opcua_arena *arena;
+
+  if (count == 0 || (uadr->notify_window && count < uadr->notify_batch &&
+    now < conn->pending_since + uadr->notify_window))
+  {
+    opcua_conn_unlock(conn);
+    return;
+  }
+
+  conn->pending = NULL;
+  conn->npending = 0;
+  conn->pending_size = 0;
+  pthread_mutex_lock(&conn->subs_mutex);
+  arena = conn->arena;
+  conn->arena = conn->spare;
+  opcua_conn_unlock(conn);
+
+  post_notifications(uadr, batch, count);
+  atomic_fetch_add(&uadr->metrics.notifications_posted, count);
+  atomic_fetch_sub(&uadr->metrics.notifications_queued, count);
+  opcua_arena_reset(arena);
+  conn->spare = arena;
+  pthread_mutex_unlock(&conn->subs_mutex);
+  free(batch);
+}
+
+/*
+ * Look for device commands made up only of monitored resources of this
+ * subscription, so that their changes can be posted as a single event.
+ */
+static void setup_notify_groups(opcua_subscription *sub,
+  const edgex_deviceprofile *profile, const char *devname)
+{
+  for (const edgex_profileresource *pr = profile->profile_resources; pr;
+    pr = pr->next)
+  {
+    uint32_t nres = 0;
+    bool usable = (pr->get != NULL);
+    notify_group *group;
+
+    for (const edgex_resourceoperation *ro = pr->get; ro && usable;
+      ro = ro->next, nres++)
+    {
+      subscription_info *item = sub->items;
+      while (item && strcmp(item->name, ro->object))
+        item = item->next;
+      usable = (item && !item->group);
+    }
+    if (!usable)
+      continue;
+
+    group = malloc(sizeof(notify_group));
+    memset(group, 0, sizeof(notify_group));
+    group->command = strdup(pr->name);
+    group->devname = strdup(devname);
+    group->nres = nres;
+    group->names = calloc(nres, sizeof(char *));
+    group->last = calloc(nres, sizeof(edgex_device_commandresult));
+    group->buffers = calloc(nres, sizeof(uint8_t *));
+    group->sizes = calloc(nres, sizeof(size_t));
+    group->seen = calloc(nres, sizeof(bool));
+    group->dirty = calloc(nres, sizeof(bool));
+
+    nres = 0;
+    for (const edgex_resourceoperation *ro = pr->get; ro; ro = ro->next, nres++)
+    {
+      subscription_info *item = sub->items;
+      while (strcmp(item->name, ro->object))
+        item = item->next;
+      item->group = group;
+      item->group_index = nres;
+      group->names[nres] = item->name;
+    }
+    group->next = sub->groups;
+    sub->groups = group;
+  }
+}
+
+/* Build the request for a monitored item from its monitoring parameters */
+static void build_monitor_request(UA_MonitoredItemCreateRequest *request,
+  UA_NodeId node, const opcua_monitor_params *params,
+  UA_DataChangeFilter *filter)
+{
+  *request = UA_MonitoredItemCreateRequest_default(node);
+  if (params->samplingInterval >= 0.0)
+    request->requestedParameters.samplingInterval = params->samplingInterval;
+  if (params->queueSize)
+    request->requestedParameters.queueSize = params->queueSize;
+  request->requestedParameters.discardOldest = params->discardOldest;
+
+  if (params->deadbandType != UA_DEADBANDTYPE_NONE)
+  {
+    UA_DataChangeFilter_init(filter);
+    filter->trigger = UA_DATACHANGETRIGGER_STATUSVALUE;
+    filter->deadbandType = params->deadbandType;
+    filter->deadbandValue = params->deadbandValue;
+    request->requestedParameters.filter.encoding =
+      UA_EXTENSIONOBJECT_DECODED_NODELETE;
+    request->requestedParameters.filter.content.decoded.type =
+      &UA_TYPES[UA_TYPES_DATACHANGEFILTER];
+    request->requestedParameters.filter.content.decoded.data = filter;
+  }
+}
+
+/* A monitored resource of a device, collected when setting up subscriptions */
+typedef struct monitored_resource
+{
+  const char *name;
+  opcua_resource *res;
+  UA_NodeId nodeId;
+  opcua_monitor_params params;
+} monitored_resource;
+
+static int compare_monitored(const void *a, const void *b)
+{
+  double ia = ((const monitored_resource *)a)->params.publishingInterval;
+  double ib = ((const monitored_resource *)b)->params.publishingInterval;
+  return (ia > ib) - (ia < ib);
+}
+
+/*
+ * Create a subscription publishing at the given interval, holding monitored
+ * items for the given resources of a device.
+ */
+static void create_subscription(UA_Client *client,
+  client_context *clientContext, opcua_device *dev, const edgex_device *device,
+  const monitored_resource *mons, uint32_t nmons, double interval,
+  UA_Byte priority)
+{
+  opcua_driver *uadr = clientContext->driver;
+  opcua_subscription *sub = NULL;
+  UA_CreateSubscriptionRequest request;
+  UA_CreateSubscriptionResponse response;
+  UA_CreateMonitoredItemsRequest monRequest;
+  UA_CreateMonitoredItemsResponse monResponse;
+  uint32_t batch = (nmons < uadr->monitor_batch) ? nmons : uadr->monitor_batch;
+  uint32_t created = 0;
+  UA_MonitoredItemCreateRequest *itemRequests;
+  UA_DataChangeFilter *filters;
+  subscription_info **items;
+  UA_Client_DataChangeNotificationCallback *callbacks;
+  UA_Client_DeleteMonitoredItemCallback *deleteCallbacks;
+
+  /* Create a subscription, owned by the connection */
+  sub = malloc(sizeof(opcua_subscription));
+  memset(sub, 0, sizeof(opcua_subscription));
+  sub->conn = clientContext->conn;
+  sub->device = dev;
+  request = UA_CreateSubscriptionRequest_default();
+  request.requestedPublishingInterval = interval;
+  request.priority = priority;
+  response = UA_Client_Subscriptions_create(client, request, sub, NULL,
+    deleteSubscriptionCallback);
+
+  if (response.responseHeader.serviceResult != UA_STATUSCODE_GOOD)
+  {
+    iot_log_error(uadr->lc, "Failed to create subscription. Status Code: %s",
+      UA_StatusCode_name(response.responseHeader.serviceResult));
+    free(sub);
+    return;
+  }
+  sub->subId = response.subscriptionId;
+  sub->interval = interval;
+  sub->priority = priority;
+  opcua_map_init(&sub->handles);
+  pthread_mutex_lock(&sub->conn->subs_mutex);
+  sub->next = sub->conn->subs;
+  sub->conn->subs = sub;
+  pthread_mutex_unlock(&sub->conn->subs_mutex);
+  iot_log_debug(uadr->lc, "Subscription %u for %s publishes every %.0fms",
+    sub->subId, device->name, response.revisedPublishingInterval);
+
+  /*
+   * Create the MonitoredItems in batches, each item's info being its
+   * context. Items whose creation fails are not kept by the client.
+   */
+  itemRequests = calloc(batch, sizeof(UA_MonitoredItemCreateRequest));
+  filters = calloc(batch, sizeof(UA_DataChangeFilter));
+  items = calloc(batch, sizeof(subscription_info *));
+  callbacks = calloc(batch, sizeof(UA_Client_DataChangeNotificationCallback));
+  deleteCallbacks = calloc(batch,
+    sizeof(UA_Client_DeleteMonitoredItemCallback));
+  for (uint32_t start = 0, n = 0; start < nmons; start += n)
+  {
+    n = (nmons - start < batch) ? nmons - start : batch;
+    for (uint32_t j = 0; j < n; j++)
+    {
+      const monitored_resource *mon = &mons[start + j];
+      subscription_info *item = malloc(sizeof(subscription_info));
+      memset(item, 0, sizeof(subscription_info));
+      item->name = strdup(mon->name);
+      item->devname = strdup(device->name);
+      item->device = dev;
+      item->res = mon->res;
+      opcua_resource_hold(item->res);
+      item->sub = sub;
+      items[j] = item;
+      callbacks[j] = subscription_handler;
+      build_monitor_request(&itemRequests[j], mon->nodeId, &mon->params,
+        &filters[j]);
+    }
+
+    UA_CreateMonitoredItemsRequest_init(&monRequest);
+    monRequest.subscriptionId = sub->subId;
+    monRequest.timestampsToReturn = UA_TIMESTAMPSTORETURN_BOTH;
+    monRequest.itemsToCreate = itemRequests;
+    monRequest.itemsToCreateSize = n;
+    monResponse = UA_Client_MonitoredItems_createDataChanges(client,
+      monRequest, (void **)items, callbacks, deleteCallbacks);
+
+    for (uint32_t j = 0; j < n; j++)
+    {
+      subscription_info *item = items[j];
+      UA_StatusCode status = monResponse.responseHeader.serviceResult;
+      if (status == UA_STATUSCODE_GOOD)
+      {
+        status = (j < monResponse.resultsSize) ?
+          monResponse.results[j].statusCode : UA_STATUSCODE_BADINTERNALERROR;
+      }
+      if (status == UA_STATUSCODE_GOOD)
+      {
+        char handle[16];
+        item->monId = monResponse.results[j].monitoredItemId;
+        item->clientHandle =
+          itemRequests[j].requestedParameters.clientHandle;
+        snprintf(handle, sizeof(handle), "%" PRIu32, item->clientHandle);
+        pthread_mutex_lock(&sub->conn->subs_mutex);
+        item->next = sub->items;
+        sub->items = item;
+        opcua_map_put(&sub->handles, handle, item);
+        pthread_mutex_unlock(&sub->conn->subs_mutex);
+        iot_log_debug(uadr->lc, "Setting up subscription for %s", item->name);
+        created++;
+      }
+      else
+      {
+        iot_log_error(uadr->lc, "Failed to set up monitored item %s: %s",
+          item->name, UA_StatusCode_name(status));
+        free_subs(item);
+      }
+    }
+    UA_CreateMonitoredItemsResponse_deleteMembers(&monResponse);
+  }
+  free(itemRequests);
+  free(filters);
+  free(items);
+  free(callbacks);
+  free(deleteCallbacks);
+  iot_log_info(uadr->lc, "Monitoring %u of %u resource(s) of %s", created,
+    nmons, device->name);
+
+  pthread_mutex_lock(&sub->conn->subs_mutex);
+  setup_notify_groups(sub, device->profile, device->name);
+  pthread_mutex_unlock(&sub->conn->subs_mutex);
+}
+
+/*
+ * Subscribe to the monitored resources of a device. Resources are grouped by
+ * their requested publishing interval, one subscription per interval, so
+ * that slow items don't hold up the publishing of fast ones. Faster
+ * subscriptions are given a higher priority.
+ */
+static void setup_device_subscriptions(UA_Client *client,
+  client_context *clientContext, opcua_device *dev)
+{
+  opcua_driver *uadr = clientContext->driver;
+  const char *devname = dev->devname;
+  edgex_device *device = NULL;
+  edgex_deviceprofile *profile = NULL;
+  edgex_deviceresource *resource = NULL;
+  monitored_resource *mons = NULL;
+  uint32_t nmons = 0;
+  uint32_t nresources = 0;
+  uint32_t nclasses = 0;
+  double dflt = UA_CreateSubscriptionRequest_default().requestedPublishingInterval;
+
+  device = uadr->ops.get_device(uadr->ops.ctx, devname);
+  if (!device)
+  {
+    iot_log_error(uadr->lc, "Couldn't find device %s", devname);
+    return;
+  }
+  if (!device->profile)
+  {
+    iot_log_error(uadr->lc, "Couldn't find device profile");
+    uadr->ops.free_device(uadr->ops.ctx, device);
+    return;
+  }
+  profile = device->profile;
+
+  /* Collect the monitored resources and their requested parameters */
+  for (resource = profile->device_resources; resource;
+    resource = resource->next)
+  {
+    nresources++;
+  }
+  mons = calloc(nresources ? nresources : 1, sizeof(monitored_resource));
+  for (resource = profile->device_resources; resource;
+    resource = resource->next)
+  {
+    monitored_resource *mon = &mons[nmons];
+    mon->res = opcua_get_subscription_resource(&uadr->resources,
+      device->name, resource);
+    if (!mon->res)
+      continue;
+    mon->name = resource->name;
+    mon->nodeId = mon->res->nodeId;
+    mon->params = mon->res->params;
+    if (mon->params.publishingInterval < 0.0)
+      mon->params.publishingInterval = dflt;
+    nmons++;
+  }
+
+  /* Order by interval, then create a subscription for each run */
+  qsort(mons, nmons, sizeof(monitored_resource), compare_monitored);
+  for (uint32_t i = 0; i < nmons; i++)
+  {
+    if (i == 0 || mons[i].params.publishingInterval !=
+      mons[i - 1].params.publishingInterval)
+    {
+      nclasses++;
+    }
+  }
+  for (uint32_t i = 0, class = 0; i < nmons; class++)
+  {
+    uint32_t n = 1;
+    double interval = mons[i].params.publishingInterval;
+    uint32_t priority = nclasses - class;
+
+    while (i + n < nmons && mons[i + n].params.publishingInterval == interval)
+      n++;
+    create_subscription(client, clientContext, dev, device, &mons[i], n,
+      interval,
+      (UA_Byte)(priority > UA_BYTE_MAX ? UA_BYTE_MAX : priority));
+    i += n;
+  }
+
+  for (uint32_t i = 0; i < nmons; i++)
+    opcua_resource_release(mons[i].res);
+  free(mons);
+  uadr->ops.free_device(uadr->ops.ctx, device);
+}
+
+/*
+ * Delete a subscription on the server. The client drops one it created
+ * itself, calling deleteSubscriptionCallback; one transferred from a lost
+ * session is unknown to it, so is deleted with the service directly.
+ */
+static UA_StatusCode delete_subscription(UA_Client *client,
+  opcua_subscription *sub)
+{
+  UA_DeleteSubscriptionsRequest request;
+  UA_DeleteSubscriptionsResponse response;
+  UA_StatusCode retval;
+
+  if (!sub->transferred)
+    return UA_Client_Subscriptions_deleteSingle(client, sub->subId);
+
+  UA_DeleteSubscriptionsRequest_init(&request);
+  request.subscriptionIds = &sub->subId;
+  request.subscriptionIdsSize = 1;
+  __UA_Client_Service(client, &request,
+    &UA_TYPES[UA_TYPES_DELETESUBSCRIPTIONSREQUEST], &response,
+    &UA_TYPES[UA_TYPES_DELETESUBSCRIPTIONSRESPONSE]);
+  retval = response.responseHeader.serviceResult;
+  if (retval == UA_STATUSCODE_GOOD)
+  {
+    retval = (response.resultsSize == 1) ?
+      response.results[0] : UA_STATUSCODE_BADINTERNALERROR;
+  }
+  UA_DeleteSubscriptionsResponse_deleteMembers(&response);
+  return retval;
+}
+
+/*
+ * Replace a device's subscriptions after its profile has changed, as their
+ * items monitor the nodes of the resources as they were and feed the last
+ * values of entries the cache no longer holds. While the session is down
+ * the device is marked instead, so that its subscriptions are recreated
+ * from the current profile once it is back rather than transferred.
+ */
+static void resubscribe_device(opcua_driver *uadr, opcua_device *dev)
+{
+  opcua_connection *conn = dev->conn;
+  opcua_subscription *sub;
+  opcua_subscription *next;
+  bool deleted = true;
+
+  pthread_mutex_lock(&conn->mutex);
+  if (UA_Client_getState(conn->client) < UA_CLIENTSTATE_SESSION)
+  {
+    dev->resubscribe = true;
+    opcua_conn_unlock(conn);
+    return;
+  }
+
+  /* The subscriptions are only changed under the conn mutex, held here */
+  for (sub = conn->subs; sub; sub = next)
+  {
+    UA_StatusCode retval;
+
+    next = sub->next;
+    if (sub->device != dev)
+      continue;
+    retval = delete_subscription(conn->client, sub);
+    if (retval != UA_STATUSCODE_GOOD)
+    {
+      iot_log_error(uadr->lc, "Failed to delete subscription %u of %s: %s",
+        sub->subId, dev->devname, UA_StatusCode_name(retval));
+      deleted = false;
+      continue;
+    }
+    free_subscription(sub);
+  }
+
+  /* A subscription left in place would duplicate the new ones */
+  if (deleted)
+  {
+    iot_log_info(uadr->lc, "Profile of %s changed, resubscribing",
+      dev->devname);
+    setup_device_subscriptions(conn->client,
+      (client_context *)UA_Client_getContext(conn->client), dev);
+  }
+  opcua_conn_unlock(conn);
+}
+
+static subscription_info *find_item_by_handle(opcua_subscription *sub,
+  UA_UInt32 clientHandle)
+{
+  char handle[16];
+  snprintf(handle, sizeof(handle), "%" PRIu32, clientHandle);
+  return (subscription_info *)opcua_map_get(&sub->handles, handle);
+}
+
+/*
+ * Queue the data changes of a notification message of a subscription, its
+ * items being found by the client handles the message gives. Changes in a
+ * republished message no newer than the item's latest are repeats of ones
+ * already posted. Returns the number of changes queued.
+ */
+static uint32_t notify_message(UA_Client *client, opcua_subscription *sub,
+  UA_NotificationMessage *msg, bool republished)
+{
+  uint32_t count = 0;
+
+  for (size_t i = 0; i < msg->notificationDataSize; i++)
+  {
+    UA_ExtensionObject *data = &msg->notificationData[i];
+    UA_DataChangeNotification *dcn;
+
+    if (data->encoding < UA_EXTENSIONOBJECT_DECODED ||
+      data->content.decoded.type != &UA_TYPES[UA_TYPES_DATACHANGENOTIFICATION])
+    {
+      continue;
+    }
+    dcn = (UA_DataChangeNotification *)data->content.decoded.data;
+    for (size_t j = 0; j < dcn->monitoredItemsSize; j++)
+    {
+      UA_MonitoredItemNotification *mon = &dcn->monitoredItems[j];
+      subscription_info *item = find_item_by_handle(sub, mon->clientHandle);
+
+      if (!item || (republished && mon->value.hasSourceTimestamp &&
+        mon->value.sourceTimestamp <= item->lastSource))
+      {
+        continue;
+      }
+      subscription_handler(client, sub->subId, sub, item->monId, item,
+        &mon->value);
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Acknowledge a notification message with the next Publish request */
+static void queue_ack(opcua_connection *conn, UA_UInt32 subId,
+  UA_UInt32 sequenceNumber)
+{
+  if (conn->nacks == conn->acks_size)
+  {
+    conn->acks_size = conn->acks_size ? conn->acks_size * 2 : 16;
+    conn->acks = realloc(conn->acks,
+      conn->acks_size * sizeof(UA_SubscriptionAcknowledgement));
+  }
+  conn->acks[conn->nacks].subscriptionId = subId;
+  conn->acks[conn->nacks++].sequenceNumber = sequenceNumber;
+}
+
+/*
+ * Completion of a Publish request, on the thread running the client. The
+ * message is routed to its subscription by id and to its items by client
+ * handle, so the subscriptions transferred from a lost session are
+ * notified just as those the client created.
+ */
+static void publish_complete(UA_Client *client, void *userdata,
+  UA_UInt32 requestId, void *response)
+{
+  opcua_connection *conn = (opcua_connection *)userdata;
+  UA_PublishResponse *res = (UA_PublishResponse *)response;
+  UA_NotificationMessage *msg = &res->notificationMessage;
+  UA_StatusCode status = res->responseHeader.serviceResult;
+  opcua_subscription *sub;
+
+  /* The requests of a replaced client are failed as it is deleted */
+  if (client != conn->client)
+    return;
+  if (conn->publishing)
+    conn->publishing--;
+  if (status != UA_STATUSCODE_GOOD)
+  {
+    /* Keep within the number of requests the server will hold */
+    if (status == UA_STATUSCODE_BADTOOMANYPUBLISHREQUESTS &&
+      conn->publish_max > 1)
+    {
+      conn->publish_max--;
+    }
+    return;
+  }
+
+  /* The subscriptions are only changed under the conn mutex, held here */
+  for (sub = conn->subs; sub && sub->subId != res->subscriptionId;
+    sub = sub->next);
+  if (sub && msg->notificationDataSize)
+  {
+    notify_message(client, sub, msg, false);
+    queue_ack(conn, sub->subId, msg->sequenceNumber);
+  }
+}
+
+/*
+ * Keep Publish requests outstanding on a connection's session, for all of
+ * its subscriptions: its client is set up to send none itself, as it would
+ * drop the messages of those it has not created. Called with the connection
+ * mutex held.
+ */
+static void opcua_publish(opcua_connection *conn)
+{
+  UA_PublishRequest request;
+
+  if (!conn->subs)
+    return;
+  while (conn->publishing < conn->publish_max)
+  {
+    UA_PublishRequest_init(&request);
+    request.subscriptionAcknowledgements = conn->acks;
+    request.subscriptionAcknowledgementsSize = conn->nacks;
+    if (__UA_Client_AsyncService(conn->client, &request,
+      &UA_TYPES[UA_TYPES_PUBLISHREQUEST], publish_complete,
+      &UA_TYPES[UA_TYPES_PUBLISHRESPONSE], conn, NULL) != UA_STATUSCODE_GOOD)
+    {
+      break;
+    }
+    conn->publishing++;
+    conn->nacks = 0;
+  }
+}
+
+/*
+ * Fetch a notification message of a detached subscription which the client
+ * may not have received, and queue its data changes as if they had just
+ * been notified. Returns the number of changes queued.
+ */
+static uint32_t republish_message(UA_Client *client, opcua_subscription *sub,
+  UA_UInt32 sequenceNumber)
+{
+  UA_RepublishRequest request;
+  UA_RepublishResponse response;
+  uint32_t count = 0;
+
+  UA_RepublishRequest_init(&request);
+  request.subscriptionId = sub->subId;
+  request.retransmitSequenceNumber = sequenceNumber;
+  __UA_Client_Service(client, &request, &UA_TYPES[UA_TYPES_REPUBLISHREQUEST],
+    &response, &UA_TYPES[UA_TYPES_REPUBLISHRESPONSE]);
+  if (response.responseHeader.serviceResult == UA_STATUSCODE_GOOD)
+    count = notify_message(client, sub, &response.notificationMessage, true);
+  UA_RepublishResponse_deleteMembers(&response);
+  return count;
+}
+
+/*
+ * Have the subscriptions of a lost session transferred to the current one.
+ * The server gives the sequence numbers of the notification messages it
+ * still holds for each, which are fetched with Republish to recover what
+ * was missed. A transferred subscription is kept, and is notified through
+ * opcua_publish from then on; those the server has discarded, or refuses
+ * to transfer (many servers don't support it), stay detached.
+ */
+static void recover_subscriptions(UA_Client *client,
+  client_context *clientContext)
+{
+  opcua_connection *conn = clientContext->conn;
+  opcua_driver *uadr = clientContext->driver;
+  UA_TransferSubscriptionsRequest transfer;
+  UA_TransferSubscriptionsResponse transferred;
+  opcua_subscription **subs;
+  opcua_subscription **pos;
+  UA_UInt32 *ids;
+  uint32_t nsubs = 0;
+  uint32_t kept = 0;
+  uint32_t recovered = 0;
+
+  /* Detached subscriptions are only changed here, under the conn mutex */
+  for (opcua_subscription *sub = conn->detached; sub; sub = sub->next)
+    nsubs++;
+  if (nsubs == 0)
+    return;
+  subs = calloc(nsubs, sizeof(opcua_subscription *));
+  ids = calloc(nsubs, sizeof(UA_UInt32));
+  nsubs = 0;
+  for (opcua_subscription *sub = conn->detached; sub; sub = sub->next)
+  {
+    sub->transferred = false;
+    subs[nsubs] = sub;
+    ids[nsubs++] = sub->subId;
+  }
+
+  UA_TransferSubscriptionsRequest_init(&transfer);
+  transfer.subscriptionIds = ids;
+  transfer.subscriptionIdsSize = nsubs;
+  transfer.sendInitialValues = false;
+  __UA_Client_Service(client, &transfer,
+    &UA_TYPES[UA_TYPES_TRANSFERSUBSCRIPTIONSREQUEST], &transferred,
+    &UA_TYPES[UA_TYPES_TRANSFERSUBSCRIPTIONSRESPONSE]);
+  if (transferred.responseHeader.serviceResult != UA_STATUSCODE_GOOD ||
+    transferred.resultsSize != nsubs)
+  {
+    iot_log_info(uadr->lc, "Subscriptions of %s not transferred: %s, "
+      "recreating them", conn->endpoint,
+      UA_StatusCode_name(transferred.responseHeader.serviceResult));
+  }
+  else
+  {
+    for (uint32_t i = 0; i < nsubs; i++)
+    {
+      UA_TransferResult *result = &transferred.results[i];
+      if (result->statusCode != UA_STATUSCODE_GOOD)
+      {
+        iot_log_debug(uadr->lc, "Subscription %u not transferred: %s",
+          ids[i], UA_StatusCode_name(result->statusCode));
+        continue;
+      }
+      subs[i]->transferred = true;
+      kept++;
+      for (size_t j = 0; j < result->availableSequenceNumbersSize; j++)
+      {
+        recovered += republish_message(client, subs[i],
+          result->availableSequenceNumbers[j]);
+        queue_ack(conn, ids[i], result->availableSequenceNumbers[j]);
+      }
+    }
+    iot_log_info(uadr->lc, "Transferred %u of %u subscription(s) of %s, "
+      "recovering %u change(s)", kept, nsubs, conn->endpoint, recovered);
+    atomic_fetch_add(&uadr->metrics.notifications_recovered, recovered);
+  }
+  UA_TransferSubscriptionsResponse_deleteMembers(&transferred);
+  free(ids);
+  free(subs);
+
+  /* Put the transferred subscriptions back in place */
+  pthread_mutex_lock(&conn->subs_mutex);
+  for (pos = &conn->detached; *pos;)
+  {
+    opcua_subscription *sub = *pos;
+    if (!sub->transferred)
+    {
+      pos = &sub->next;
+      continue;
+    }
+    *pos = sub->next;
+    sub->next = conn->subs;
+    conn->subs = sub;
+  }
+  pthread_mutex_unlock(&conn->subs_mutex);
+}
+
+/*
+ * Create a subscription in place of a detached one which could not be
+ * transferred, monitoring the same resources at the same interval.
+ */
+static void recreate_subscription(UA_Client *client,
+  client_context *clientContext, opcua_subscription *sub)
+{
+  opcua_driver *uadr = clientContext->driver;
+  edgex_device *device;
+  monitored_resource *mons;
+  uint32_t nmons = 0;
+
+  device = uadr->ops.get_device(uadr->ops.ctx, sub->device->devname);
+  if (!device || !device->profile)
+  {
+    iot_log_error(uadr->lc, "Couldn't find device %s",
+      sub->device->devname);
+    if (device)
+      uadr->ops.free_device(uadr->ops.ctx, device);
+    return;
+  }
+  for (subscription_info *item = sub->items; item; item = item->next)
+    nmons++;
+  mons = calloc(nmons ? nmons : 1, sizeof(monitored_resource));
+  nmons = 0;
+  for (subscription_info *item = sub->items; item; item = item->next)
+  {
+    monitored_resource *mon = &mons[nmons++];
+    mon->name = item->name;
+    mon->res = item->res;
+    mon->nodeId = item->res->nodeId;
+    mon->params = item->res->params;
+    if (mon->params.publishingInterval < 0.0)
+      mon->params.publishingInterval = sub->interval;
+  }
+  create_subscription(client, clientContext, sub->device, device, mons, nmons,
+    sub->interval, sub->priority);
+  free(mons);
+  uadr->ops.free_device(uadr->ops.ctx, device);
+}
+
+/*
+ * Subscribe to the monitored resources of every device on a connection as
+ * a session starts. A device keeps the subscriptions transferred from the
+ * lost session, and only those which could not be are created again; one
+ * with none transferred, or whose profile changed meanwhile, is subscribed
+ * from its profile.
+ */
+static void setup_subscriptions(UA_Client *client)
+{
+  client_context *clientContext;
+  opcua_connection *conn;
+
+  clientContext = (client_context *)UA_Client_getContext(client);
+  if (!clientContext)
+    return;
+  conn = clientContext->conn;
+
+  for (opcua_device *dev = conn->devices; dev; dev = dev->next)
+  {
+    opcua_subscription *sub;
+    opcua_subscription *next;
+    bool kept = false;
+
+    for (sub = conn->subs; sub; sub = next)
+    {
+      next = sub->next;
+      if (sub->device != dev)
+        continue;
+      if (!dev->resubscribe)
+      {
+        kept = true;
+        continue;
+      }
+      (void)delete_subscription(client, sub);
+      free_subscription(sub);
+    }
+    dev->resubscribe = false;
+
+    if (!kept)
+    {
+      setup_device_subscriptions(client, clientContext, dev);
+      continue;
+    }
+    for (sub = conn->detached; sub; sub = sub->next)
+    {
+      if (sub->device == dev)
+        recreate_subscription(client, clientContext, sub);
+    }
+  }
+}
+
+/*
+ * Callback function to allow creation of subscriptions once connection to
+ * server has been established.
+ */
+static void stateCallback(UA_Client *client, UA_ClientState clientState)
+{
+  client_context *clientContext;
+
+  switch(clientState)
+  {
+    case UA_CLIENTSTATE_SESSION:
+      /*
+       * A new session was created. Take over the subscriptions of a lost
+       * one, then create any which could not be.
+       */
+      clientContext = (client_context *)UA_Client_getContext(client);
+      if (clientContext)
+        recover_subscriptions(client, clientContext);
+      setup_subscriptions(client);
+      break;
+    case UA_CLIENTSTATE_SESSION_RENEWED:
+      /* The session was renewed. We don't need to recreate subscriptions. */
+    default:
+      /* Ignore other session state changes for now. */
+      break;
+  }
+  return;
+}
+
+/* The connection currently being connected by this thread */
+static __thread opcua_connection *connecting_conn;
+
+/*
+ * Client connection function which records the socket of the new connection
+ * so that the loop threads can wait on it.
+ */
+static UA_Connection opcua_connection_tcp(UA_ConnectionConfig conf,
+  const char *endpointUrl, const UA_UInt32 timeout, UA_Logger logger)
+{
+  UA_Connection connection = UA_ClientConnectionTCP(conf, endpointUrl,
+    timeout, logger);
+  if (connecting_conn)
+  {
+    atomic_store(&connecting_conn->sockfd, connection.sockfd);
+    atomic_fetch_add(&connecting_conn->sock_gen, 1);
+  }
+  return connection;
+}
+
+/* Creates the opcua channel and session */
+static UA_StatusCode opcua_connect(opcua_connection *conn, UA_Client *client)
+{
+  UA_StatusCode retval;
+  /* TODO: When supported connect with user & password */
+  connecting_conn = conn;
+  retval = UA_Client_connect(client, conn->endpoint);
+  connecting_conn = NULL;
+  return retval;
+}
+
+/* Deletes a connection's client and everything the connection owns */
+static void free_connection(void *value)
+{
+  opcua_connection *conn = (opcua_connection *)value;
+  client_context *clientContext = NULL;
+
+  if (conn->client)
+  {
+    /* Deleting the client releases its subscriptions via their callbacks */
+    clientContext = (client_context *)UA_Client_getContext(conn->client);
+    UA_Client_delete(conn->client);
+    free(clientContext);
+  }
+  while (conn->subs)
+  {
+    free_subscription(conn->subs);
+  }
+  while (conn->detached)
+  {
+    free_subscription(conn->detached);
+  }
+  free(conn->pending);
+  free(conn->acks);
+  opcua_arena_fini(&conn->arenas[0]);
+  opcua_arena_fini(&conn->arenas[1]);
+  while (conn->devices)
+  {
+    opcua_device *next = conn->devices->next;
+    free(conn->devices->devname);
+    free(conn->devices);
+    conn->devices = next;
+  }
+  pthread_mutex_destroy(&conn->state_mutex);
+  pthread_cond_destroy(&conn->state_cond);
+  free(conn->addr_id);
+  free(conn->endpoint);
+  free(conn);
+}
+
+/* Builds the endpoint URL of a device from its protocol properties */
+static char *opcua_endpoint(opcua_driver *uadr, const edgex_protocols *protocol)
+{
+  const char *address = NULL;
+  uint64_t port = 0;
+  const char *path = NULL;
+  edgex_nvpairs *pos = protocol->properties;
+
+  for (const edgex_protocols *current = protocol; current;
+    current = current->next)
+  {
+    if (!strcmp(protocol->name, "OPC-UA"))
+    {
+      /*
+       * Need to ensure we have enough information specified in order to
+       * establish the connection.
+       */
+      while (pos)
+      {
+        if (!strcmp(pos->name, "Address"))
+        {
+          if (!address)
+            address = pos->value;
+        }
+        else if (!strcmp(pos->name, "Port"))
+        {
+          if (!port)
+            port = strtol(pos->value, NULL, 10);
+        }
+        else if (!strcmp(pos->name, "Path"))
+        {
+          if (!path)
+            path = pos->value;
+        }
+        pos = pos->next;
+      }
+      break;
+    }
+  }
+
+  if (!address || !path || !port)
+  {
+    iot_log_error(uadr->lc, "Failed to create client - missing config info");
+    return NULL;
+  }
+  iot_log_debug(uadr->lc,
+    "Got connection info of addr %s port %lu path %s\n", address, port, path);
+
+  /* Construct the endpoint */
+  /* Fix magic const */
+  char *endpoint = malloc(strlen(PROTOCOL) + strlen(address) + 20 * sizeof(char) + strlen(path));
+  sprintf(endpoint, "%s%s:%"PRIu64"%s", PROTOCOL, address, port, path);
+  return endpoint;
+}
+
+/*
+ * Creates a client for a connection with the connection's client context,
+ * which each client it has in turn shares. The client is left to send no
+ * Publish requests, opcua_publish keeps as many outstanding as it would.
+ */
+static UA_Client *create_client(opcua_connection *conn,
+  client_context *context)
+{
+  UA_ClientConfig config = UA_ClientConfig_default;
+
+  config.clientContext = (void *)context;
+  /* Set stateCallback, where subscriptions will be set up */
+  config.stateCallback = stateCallback;
+  config.connectionFunc = opcua_connection_tcp;
+  conn->publish_max = config.outStandingPublishRequests;
+  config.outStandingPublishRequests = 0;
+  return UA_Client_new(config);
+}
+
+/*
+ * Creates and returns a new opcua_connection to an endpoint, which it takes
+ * ownership of, serving the given device. The connection is CONNECTING, its
+ * client yet to connect. Returns NULL if the client can't be created.
+ */
+static opcua_connection *create_opcua_connection(opcua_driver *uadr,
+    const char *devname, char *endpoint)
+{
+  UA_Client *client = NULL;
+
+  /* Create and return the opcua_connection */
+  opcua_connection *conn = malloc(sizeof(opcua_connection));
+  memset(conn, 0, sizeof(opcua_connection));
+  conn->driver = uadr;
+  pthread_mutex_init(&conn->mutex, NULL);
+  pthread_mutex_init(&conn->subs_mutex, NULL);
+  pthread_mutex_init(&conn->state_mutex, NULL);
+  pthread_cond_init(&conn->state_cond, NULL);
+  atomic_init(&conn->state, OPCUA_CONN_CONNECTING);
+  atomic_init(&conn->sockfd, -1);
+  atomic_init(&conn->sock_gen, 0);
+  conn->polled_fd = -1;
+  opcua_arena_init(&conn->arenas[0]);
+  opcua_arena_init(&conn->arenas[1]);
+  conn->arena = &conn->arenas[0];
+  conn->spare = &conn->arenas[1];
+  conn->endpoint = endpoint;
+  conn->addr_id = strdup(endpoint);
+
+  /* The device is in place before connecting so it gets its subscriptions */
+  conn->devices = malloc(sizeof(opcua_device));
+  conn->devices->devname = strdup(devname);
+  conn->devices->conn = conn;
+  conn->devices->resubscribe = false;
+  conn->devices->next = NULL;
+  opcua_latency_init(&conn->devices->latency);
+
+  /* create the client */
+  /*
+   * Need to attach driver to clientContext to allow us to retrieve the
+   * structure during stateCallback. The connection holds the devices whose
+   * readings are posted to EdgeX.
+   */
+  client_context *context = (void *)malloc(sizeof(client_context));
+  context->driver = (void *)uadr;
+  context->conn = conn;
+  client = create_client(conn, context);
+  if (client == NULL)
+  {
+    iot_log_error(uadr->lc, "Failed to create client");
+    free(context);
+    free_connection(conn);
+    return NULL;
+  }
+  conn->client = client;
+  return conn;
+}
+
+/*
+ * Make the first connect of a new connection. The connection is already
+ * published, so concurrent requests for its devices wait on this connect
+ * rather than making their own. If it fails the connection is left DOWN for
+ * the reconnect supervisor to retry.
+ */
+static void opcua_first_connect(opcua_driver *uadr, opcua_connection *conn)
+{
+  UA_StatusCode retval;
+
+  pthread_mutex_lock(&conn->mutex);
+  retval = opcua_connect(conn, conn->client);
+  opcua_conn_unlock(conn);
+
+  pthread_mutex_lock(&conn->state_mutex);
+  if (retval == UA_STATUSCODE_GOOD)
+  {
+    iot_log_info(uadr->lc, "Connected to OPC-UA endpoint {%s}",
+      conn->endpoint);
+    conn->state = OPCUA_CONN_UP;
+  }
+  else
+  {
+    conn->backoff = uadr->reconnect_delay;
+    conn->retry_at = opcua_now_ms() + conn->backoff;
+    conn->state = OPCUA_CONN_DOWN;
+    iot_log_error(uadr->lc,
+      "Client failed to connect to {%s}. Status Code: %s, retrying in %ums",
+      conn->endpoint, UA_StatusCode_name(retval), conn->backoff);
+  }
+  pthread_cond_broadcast(&conn->state_cond);
+  pthread_mutex_unlock(&conn->state_mutex);
+
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    pthread_mutex_lock(&uadr->sup_mutex);
+    pthread_cond_signal(&uadr->sup_cond);
+    pthread_mutex_unlock(&uadr->sup_mutex);
+  }
+}
+
+/*
+ * Hand a connection whose session has been lost to the reconnect supervisor.
+ * The first attempt is made straight away.
+ */
+static void opcua_conn_lost(opcua_driver *uadr, opcua_connection *conn)
+{
+  bool lost = false;
+
+  pthread_mutex_lock(&conn->state_mutex);
+  if (conn->state == OPCUA_CONN_UP)
+  {
+    conn->state = OPCUA_CONN_DOWN;
+    conn->backoff = 0;
+    conn->retry_at = opcua_now_ms();
+    lost = true;
+  }
+  pthread_mutex_unlock(&conn->state_mutex);
+
+  if (lost)
+  {
+    iot_log_warning(uadr->lc, "Connection id: %s is malfunctioning",
+      conn->addr_id);
+
+    /* Changes are no longer being notified, so GETs go to the server */
+    pthread_mutex_lock(&conn->subs_mutex);
+    for (opcua_subscription *sub = conn->subs; sub; sub = sub->next)
+    {
+      for (subscription_info *item = sub->items; item; item = item->next)
+        opcua_last_value_invalidate(&item->res->last);
+    }
+    pthread_mutex_unlock(&conn->subs_mutex);
+    pthread_mutex_lock(&uadr->sup_mutex);
+    pthread_cond_signal(&uadr->sup_cond);
+    pthread_mutex_unlock(&uadr->sup_mutex);
+  }
+}
+
+/*
+ * Set aside the subscriptions of a lost session until the next one has had
+ * them transferred. The client does not drop those it did not create.
+ */
+static void detach_subscriptions(opcua_connection *conn)
+{
+  pthread_mutex_lock(&conn->subs_mutex);
+  while (conn->subs)
+  {
+    opcua_subscription *sub = conn->subs;
+    conn->subs = sub->next;
+    sub->next = conn->detached;
+    conn->detached = sub;
+  }
+  pthread_mutex_unlock(&conn->subs_mutex);
+}
+
+/*
+ * Connect again with a new session, on a fresh client. The lost session is
+ * not closed, so the server keeps it and its subscriptions until they time
+ * out, and stateCallback can have them transferred to the new one. The old
+ * client is only deleted after that: disconnecting it first would close a
+ * session it still thought it had, deleting the subscriptions with it. The
+ * connection mutex is held throughout, so the loop threads pass the
+ * connection by and requests are turned away by its state rather than
+ * waiting on the connect.
+ */
+static void opcua_reconnect(opcua_driver *uadr, opcua_connection *conn,
+  unsigned *seed)
+{
+  UA_Client *old;
+  UA_StatusCode retval = UA_STATUSCODE_BADOUTOFMEMORY;
+  uint32_t delay;
+
+  pthread_mutex_lock(&conn->state_mutex);
+  conn->state = OPCUA_CONN_RECONNECTING;
+  conn->reconnect_count++;
+  iot_log_info(uadr->lc, "Attempting reconnect no: %d of id: %s",
+    conn->reconnect_count, conn->addr_id);
+  pthread_mutex_unlock(&conn->state_mutex);
+  atomic_fetch_add(&uadr->metrics.reconnects, 1);
+
+  pthread_mutex_lock(&conn->mutex);
+  /* Stop watching the old socket before the client closes it */
+  opcua_loop_watch(conn, -1, 0);
+  detach_subscriptions(conn);
+  old = conn->client;
+  conn->client = create_client(conn,
+    (client_context *)UA_Client_getContext(old));
+  if (conn->client)
+  {
+    conn->publishing = 0;
+    conn->nacks = 0;
+    retval = opcua_connect(conn, conn->client);
+    /* Its subscriptions were set aside, so it no longer touches them */
+    UA_Client_delete(old);
+  }
+  else
+  {
+    iot_log_error(uadr->lc, "Failed to create client");
+    conn->client = old;
+  }
+  if (retval == UA_STATUSCODE_GOOD)
+  {
+    /* Post the recovered changes before their subscriptions are freed */
+    flush_notifications(uadr, conn, UINT64_MAX);
+    pthread_mutex_lock(&conn->mutex);
+    while (conn->detached)
+      free_subscription(conn->detached);
+  }
+  opcua_conn_unlock(conn);
+
+  pthread_mutex_lock(&conn->state_mutex);
+  if (retval == UA_STATUSCODE_GOOD)
+  {
+    iot_log_info(uadr->lc, "Reconnect Successful. Status Code: %s",
+      UA_StatusCode_name(retval));
+    conn->state = OPCUA_CONN_UP;
+    conn->backoff = 0;
+    pthread_cond_broadcast(&conn->state_cond);
+  }
+  else
+  {
+    /* Exponential backoff, with jitter so that endpoints don't retry in step */
+    conn->backoff = conn->backoff ? conn->backoff * 2 : uadr->reconnect_delay;
+    if (conn->backoff > uadr->reconnect_max_delay)
+      conn->backoff = uadr->reconnect_max_delay;
+    delay = conn->backoff / 2 + (uint32_t)rand_r(seed) % (conn->backoff / 2 + 1);
+    conn->retry_at = opcua_now_ms() + delay;
+    conn->state = OPCUA_CONN_DOWN;
+    atomic_fetch_add(&uadr->metrics.reconnect_failures, 1);
+    iot_log_error(uadr->lc,
+      "Client failed to connect. Status Code: %s, retrying in %ums",
+      UA_StatusCode_name(retval), delay);
+  }
+  pthread_mutex_unlock(&conn->state_mutex);
+}
+
+/* Connections due a reconnect attempt, gathered by the supervisor */
+typedef struct reconnect_scan
+{
+  uint64_t now;
+  uint64_t next;
+  opcua_connection **due;
+  uint32_t ndue;
+  uint32_t size;
+} reconnect_scan;
+
+static void scan_connection(const char *key, void *value, void *arg)
+{
+  opcua_connection *conn = (opcua_connection *)value;
+  reconnect_scan *scan = (reconnect_scan *)arg;
+
+  pthread_mutex_lock(&conn->state_mutex);
+  if (conn->state == OPCUA_CONN_DOWN)
+  {
+    if (conn->retry_at <= scan->now)
+    {
+      if (scan->ndue == scan->size)
+      {
+        scan->size = scan->size ? scan->size * 2 : 8;
+        scan->due = realloc(scan->due, scan->size * sizeof(opcua_connection *));
+      }
+      scan->due[scan->ndue++] = conn;
+    }
+    else if (conn->retry_at < scan->next)
+    {
+      scan->next = conn->retry_at;
+    }
+  }
+  pthread_mutex_unlock(&conn->state_mutex);
+}
+
+static void opcua_supervisor_wake(opcua_driver *uadr)
+{
+  pthread_mutex_lock(&uadr->sup_mutex);
+  pthread_cond_signal(&uadr->sup_cond);
+  pthread_mutex_unlock(&uadr->sup_mutex);
+}
+
+/* Wake the supervisor if a resource lookup has recorded a profile change */
+static void opcua_check_changes(opcua_driver *uadr)
+{
+  if (atomic_load(&uadr->resources.changes) !=
+    atomic_load(&uadr->changes_seen))
+  {
+    opcua_supervisor_wake(uadr);
+  }
+}
+
+static void collect_device(const char *key, void *value, void *arg)
+{
+  opcua_device ***pos = (opcua_device ***)arg;
+  *(*pos)++ = (opcua_device *)value;
+}
+
+/*
+ * Resubscribe the devices which the resource cache has recorded as changed,
+ * and rebuild the poll groups of their connections
+ */
+static void update_changed_devices(opcua_driver *uadr)
+{
+  opcua_device **devices;
+  opcua_device **end;
+  opcua_connection **conns;
+  uint32_t nconns = 0;
+
+  pthread_rwlock_rdlock(&uadr->conn_lock);
+  devices = calloc(uadr->devices.count + 1, sizeof(opcua_device *));
+  end = devices;
+  opcua_map_foreach(&uadr->devices, collect_device, &end);
+  pthread_rwlock_unlock(&uadr->conn_lock);
+  conns = calloc(end - devices + 1, sizeof(opcua_connection *));
+
+  /* Devices are only removed at stop, after this thread has exited */
+  for (opcua_device **dev = devices; dev < end; dev++)
+  {
+    uint32_t i = 0;
+
+    if (!opcua_resource_cache_take_changed(&uadr->resources, (*dev)->devname))
+      continue;
+    resubscribe_device(uadr, *dev);
+    while (i < nconns && conns[i] != (*dev)->conn)
+      i++;
+    if (i == nconns)
+      conns[nconns++] = (*dev)->conn;
+  }
+  for (uint32_t i = 0; i < nconns; i++)
+    setup_connection_polling(uadr, conns[i]);
+  free(conns);
+  free(devices);
+}
+
+/*
+ * Look through the service's devices. Those not yet in use which have
+ * monitored or polled resources are connected, so that they are watched
+ * without waiting for a GET or PUT. The cached resources of the others are
+ * brought into line with their profiles, recording any changes to them.
+ */
+static void scan_devices(opcua_driver *uadr)
+{
+  edgex_device *devices = uadr->ops.get_devices(uadr->ops.ctx);
+
+  for (edgex_device *device = devices; device; device = device->next)
+  {
+    bool known;
+    bool watched = false;
+
+    if (!device->profile)
+      continue;
+    pthread_rwlock_rdlock(&uadr->conn_lock);
+    known = (opcua_map_get(&uadr->devices, device->name) != NULL);
+    pthread_rwlock_unlock(&uadr->conn_lock);
+    opcua_resource_cache_update(&uadr->resources, device->name,
+      device->profile);
+    if (known)
+      continue;
+
+    for (const edgex_deviceresource *resource =
+      device->profile->device_resources; resource && !watched;
+      resource = resource->next)
+    {
+      opcua_resource *res = opcua_get_device_resource(&uadr->resources,
+        device->name, resource);
+      watched = (res->monitored || res->pollInterval);
+      opcua_resource_release(res);
+    }
+    if (watched)
+    {
+      iot_log_info(uadr->lc, "Connecting device {%s} to watch its resources",
+        device->name);
+      find_opcua_connection(uadr, device->name, device->protocols);
+      /* It was set up from its profile as it is now */
+      (void)opcua_resource_cache_take_changed(&uadr->resources,
+        device->name);
+    }
+  }
+  if (devices)
+    uadr->ops.free_device(uadr->ops.ctx, devices);
+}
+
+/*
+ * The supervisor reconnects lost sessions, and retries failed first connects,
+ * in the background so that GET and PUT requests never wait on a reconnect.
+ * Every DeviceScanInterval it also looks for devices to connect and profiles
+ * which have changed. It sleeps until the next endpoint is due a retry or
+ * the next scan is due, until a loop thread reports a lost session, or until
+ * a request finds a profile has changed.
+ */
+static void *opcua_supervisor_thread(void *arg)
+{
+  opcua_driver *uadr = (opcua_driver *)arg;
+  reconnect_scan scan;
+  unsigned seed = (unsigned)opcua_now_ms();
+  struct timespec deadline;
+  uint64_t next_scan = opcua_now_ms();
+
+  memset(&scan, 0, sizeof(scan));
+  pthread_mutex_lock(&uadr->sup_mutex);
+  while (uadr->sup_running)
+  {
+    unsigned changes;
+
+    if (uadr->device_scan && opcua_now_ms() >= next_scan)
+    {
+      pthread_mutex_unlock(&uadr->sup_mutex);
+      scan_devices(uadr);
+      next_scan = opcua_now_ms() + (uint64_t)uadr->device_scan * 1000;
+      pthread_mutex_lock(&uadr->sup_mutex);
+      continue;
+    }
+
+    changes = atomic_load(&uadr->resources.changes);
+    if (changes != atomic_load(&uadr->changes_seen))
+    {
+      atomic_store(&uadr->changes_seen, changes);
+      pthread_mutex_unlock(&uadr->sup_mutex);
+      update_changed_devices(uadr);
+      pthread_mutex_lock(&uadr->sup_mutex);
+      continue;
+    }
+
+    scan.now = opcua_now_ms();
+    scan.next = scan.now + uadr->reconnect_max_delay;
+    if (uadr->device_scan && next_scan < scan.next)
+      scan.next = next_scan;
+    scan.ndue = 0;
+    pthread_rwlock_rdlock(&uadr->conn_lock);
+    opcua_map_foreach(&uadr->connections, scan_connection, &scan);
+    pthread_rwlock_unlock(&uadr->conn_lock);
+
+    if (scan.ndue)
+    {
+      /* Connections are only removed at stop, after this thread has exited */
+      pthread_mutex_unlock(&uadr->sup_mutex);
+      for (uint32_t i = 0; i < scan.ndue; i++)
+      {
+        opcua_reconnect(uadr, scan.due[i], &seed);
+      }
+      pthread_mutex_lock(&uadr->sup_mutex);
+      continue;
+    }
+    opcua_deadline(&deadline, (uint32_t)(scan.next - scan.now));
+    pthread_cond_timedwait(&uadr->sup_cond, &uadr->sup_mutex, &deadline);
+  }
+  pthread_mutex_unlock(&uadr->sup_mutex);
+  free(scan.due);
+  return NULL;
+}
+
+static void opcua_supervisor_start(opcua_driver *uadr)
+{
+  pthread_mutex_init(&uadr->sup_mutex, NULL);
+  pthread_cond_init(&uadr->sup_cond, NULL);
+  uadr->sup_running = true;
+  pthread_create(&uadr->supervisor, NULL, opcua_supervisor_thread, uadr);
+}
+
+static void opcua_supervisor_stop(opcua_driver *uadr)
+{
+  pthread_mutex_lock(&uadr->sup_mutex);
+  uadr->sup_running = false;
+  pthread_cond_signal(&uadr->sup_cond);
+  pthread_mutex_unlock(&uadr->sup_mutex);
+  pthread_join(uadr->supervisor, NULL);
+}
+
+/* Once the loop threads, which report lost sessions, have stopped too */
+static void opcua_supervisor_free(opcua_driver *uadr)
+{
+  pthread_mutex_destroy(&uadr->sup_mutex);
+  pthread_cond_destroy(&uadr->sup_cond);
+}
+
+/*
+ * Check that a connection's session is up before issuing a request. While a
+ * new connection makes its first connect the caller waits for it, up to
+ * RequestTimeout. If the session is lost or being reconnected the caller
+ * waits up to ConnectWait for it, by default failing straight away.
+ */
+static bool opcua_wait_connected(opcua_driver *uadr, opcua_connection *conn)
+{
+  struct timespec connecting;
+  struct timespec deadline;
+  int state;
+  int rc = 0;
+  bool up;
+
+  if (atomic_load(&conn->state) == OPCUA_CONN_UP)
+    return true;
+
+  opcua_deadline(&connecting, uadr->request_timeout);
+  opcua_deadline(&deadline, uadr->connect_wait);
+  pthread_mutex_lock(&conn->state_mutex);
+  while (rc == 0 && (state = conn->state) != OPCUA_CONN_UP)
+  {
+    if (state == OPCUA_CONN_CONNECTING)
+      rc = pthread_cond_timedwait(&conn->state_cond, &conn->state_mutex,
+        &connecting);
+    else if (uadr->connect_wait)
+      rc = pthread_cond_timedwait(&conn->state_cond, &conn->state_mutex,
+        &deadline);
+    else
+      break;
+  }
+  up = (conn->state == OPCUA_CONN_UP);
+  pthread_mutex_unlock(&conn->state_mutex);
+  if (!up)
+    atomic_fetch_add(&uadr->metrics.unavailable, 1);
+  return up;
+}
+
+/*
+ * Keep the loop's epoll set watching the connection's current socket. It is
+ * watched one event at a time: each event delivered disarms it, and it is
+ * armed again once the client has been run, so a socket left readable while
+ * another thread holds the connection doesn't wake the loop over and over.
+ * The generation guards against a new socket reusing the old descriptor
+ * number. Called with the connection mutex held. Pass a negative fd to stop
+ * watching, which must be done before the client closes the socket, as
+ * another connection may be given its number.
+ */
+static void opcua_loop_watch(opcua_connection *conn, int fd, unsigned gen)
+{
+  struct epoll_event ev;
+
+  if (fd == conn->polled_fd && (fd < 0 || gen == conn->polled_gen))
+  {
+    if (fd < 0 || atomic_exchange(&conn->armed, true))
+      return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    (void)epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+    return;
+  }
+
+  if (conn->polled_fd >= 0)
+    (void)epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->polled_fd, NULL);
+  conn->polled_fd = -1;
+
+  if (fd >= 0)
+  {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    {
+      conn->polled_fd = fd;
+      conn->polled_gen = gen;
+      atomic_store(&conn->armed, true);
+    }
+  }
+}
+
+/*
+ * Run a single non-blocking iteration of a client. If a request currently
+ * holds the connection it is processing the client's input itself; the
+ * connection is marked so that the request wakes the loop to service it
+ * once it is done, and is otherwise left until its next housekeeping run,
+ * as the holder may keep it for as long as a connect takes.
+ */
+static void opcua_loop_service(opcua_loop *loop, opcua_connection *conn,
+  uint64_t now)
+{
+  bool active = false;
+  uint64_t start;
+
+  if (pthread_mutex_trylock(&conn->mutex) != 0)
+  {
+    /* Try again in case the holder left before seeing the mark */
+    atomic_store(&conn->deferred, true);
+    if (pthread_mutex_trylock(&conn->mutex) != 0)
+    {
+      conn->next_run = now + loop->driver->loop_interval;
+      return;
+    }
+  }
+  atomic_store(&conn->deferred, false);
+  start = opcua_now_us();
+  /* Run client iterate assuming the session is active */
+  if (UA_Client_getState(conn->client) >= UA_CLIENTSTATE_SESSION)
+  {
+    UA_Client_runAsync(conn->client, 0);
+    active = (UA_Client_getState(conn->client) >= UA_CLIENTSTATE_SESSION);
+    if (active)
+      opcua_publish(conn);
+  }
+  if (!active)
+    opcua_conn_lost(loop->driver, conn);
+
+  /* Only watch the socket of an active session, a dead one stays readable */
+  opcua_loop_watch(conn, active ? atomic_load(&conn->sockfd) : -1,
+    atomic_load(&conn->sock_gen));
+
+  conn->next_run = now + loop->driver->loop_interval;
+  if (conn->npending && loop->driver->notify_window &&
+    conn->pending_since + loop->driver->notify_window < conn->next_run)
+  {
+    conn->next_run = conn->pending_since + loop->driver->notify_window;
+  }
+  flush_notifications(loop->driver, conn, now);
+  atomic_fetch_add(&loop->driver->metrics.loop_runs, 1);
+  opcua_histogram_record(&loop->driver->metrics.loop_time,
+    (int64_t)(opcua_now_us() - start));
+}
+
+/*
+ * Each loop thread is a reactor for its own shard of the connections. It
+ * waits in epoll on the clients' sockets and only iterates a client when
+ * data has arrived, or when its housekeeping timer (publish requests,
+ * keep-alive, channel renewal) falls due, so idle connections cost nothing
+ * between timers.
+ */
+static void *opcua_loop_thread(void *arg)
+{
+  opcua_loop *loop = (opcua_loop *)arg;
+  opcua_driver *driver = loop->driver;
+  struct epoll_event events[LOOP_MAX_EVENTS];
+
+  while (atomic_load(&driver->loops_running))
+  {
+    uint64_t now = opcua_now_ms();
+    uint64_t next = now + driver->loop_interval;
+    uint32_t ndue = 0;
+    int n;
+
+    /* Deferred clients are brought back by their holder waking the loop */
+    pthread_mutex_lock(&loop->mutex);
+    for (uint32_t i = 0; i < loop->length; i++)
+    {
+      opcua_connection *conn = loop->conns[i];
+      if (!atomic_load(&conn->deferred) && conn->next_run < next)
+        next = conn->next_run;
+    }
+    pthread_mutex_unlock(&loop->mutex);
+
+    n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS,
+      next > now ? (int)(next - now) : 0);
+    now = opcua_now_ms();
+
+    for (int i = 0; i < n; i++)
+    {
+      opcua_connection *conn = (opcua_connection *)events[i].data.ptr;
+      if (conn == NULL)
+      {
+        uint64_t count;
+        (void)read(loop->wakefd, &count, sizeof(count));
+        continue;
+      }
+      atomic_store(&conn->armed, false);
+      opcua_loop_service(loop, conn, now);
+    }
+
+    /*
+     * Service the clients due a run, or released by another thread. They
+     * are serviced outside the loop's mutex, as posting their changes may
+     * block on core-data; connections are only removed at stop.
+     */
+    pthread_mutex_lock(&loop->mutex);
+    if (loop->due_size < loop->length)
+    {
+      loop->due_size = loop->capacity;
+      loop->due = realloc(loop->due,
+        loop->due_size * sizeof(opcua_connection *));
+    }
+    for (uint32_t i = 0; i < loop->length; i++)
+    {
+      opcua_connection *conn = loop->conns[i];
+      if (conn->next_run <= now || atomic_load(&conn->deferred))
+        loop->due[ndue++] = conn;
+    }
+    pthread_mutex_unlock(&loop->mutex);
+    for (uint32_t i = 0; i < ndue; i++)
+      opcua_loop_service(loop, loop->due[i], now);
+  }
+  return NULL;
+}
+
+/* Assign a newly registered connection to a loop thread, round robin */
+static void opcua_loop_add(opcua_driver *uadr, opcua_connection *conn)
+{
+  opcua_loop *loop;
+
+  pthread_mutex_lock(&uadr->mutex);
+  loop = &uadr->loops[uadr->next_loop++ % uadr->nloops];
+  pthread_mutex_unlock(&uadr->mutex);
+
+  pthread_mutex_lock(&loop->mutex);
+  if (loop->length == loop->capacity)
+  {
+    loop->capacity = loop->capacity ? loop->capacity * 2 : 8;
+    loop->conns = realloc(loop->conns,
+      loop->capacity * sizeof(opcua_connection *));
+  }
+  conn->next_run = 0;
+  conn->loop = loop;
+  loop->conns[loop->length++] = conn;
+  pthread_mutex_unlock(&loop->mutex);
+  opcua_loop_wake(loop);
+}
+
+static void opcua_loops_start(opcua_driver *uadr)
+{
+  uadr->loops = calloc(uadr->nloops, sizeof(opcua_loop));
+  atomic_store(&uadr->loops_running, true);
+  for (uint32_t i = 0; i < uadr->nloops; i++)
+  {
+    opcua_loop *loop = &uadr->loops[i];
+    struct epoll_event ev;
+
+    loop->driver = uadr;
+    pthread_mutex_init(&loop->mutex, NULL);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+    pthread_create(&loop->thread, NULL, opcua_loop_thread, loop);
+  }
+}
+
+static void opcua_loops_stop(opcua_driver *uadr)
+{
+  atomic_store(&uadr->loops_running, false);
+  for (uint32_t i = 0; i < uadr->nloops; i++)
+  {
+    opcua_loop_wake(&uadr->loops[i]);
+    pthread_join(uadr->loops[i].thread, NULL);
+    close(uadr->loops[i].epfd);
+    close(uadr->loops[i].wakefd);
+    pthread_mutex_destroy(&uadr->loops[i].mutex);
+    free(uadr->loops[i].conns);
+    free(uadr->loops[i].due);
+  }
+  free(uadr->loops);
+  uadr->loops = NULL;
+  uadr->nloops = 0;
+}
+
+/* ---- Polling ---- */
+/*
+ * Completion of a poll group's read, on the thread running the client. The
+ * response is handed over to the poller to be posted.
+ */
+static void poll_complete(UA_Client *client, void *userdata,
+  UA_UInt32 requestId, void *response)
+{
+  opcua_poll_group *group = (opcua_poll_group *)userdata;
+  opcua_poller *poller = &group->conn->driver->poller;
+
+  memcpy(&group->response, response, sizeof(UA_ReadResponse));
+  UA_init(response, &UA_TYPES[UA_TYPES_READRESPONSE]);
+  pthread_mutex_lock(&poller->mutex);
+  group->next_done = poller->done;
+  poller->done = group;
+  pthread_cond_signal(&poller->cond);
+  pthread_mutex_unlock(&poller->mutex);
+}
+
+/*
+ * Send the read of a poll group without waiting for it. A group is passed
+ * over while its connection is down or its last read is outstanding.
+ */
+static void poll_group_read(opcua_driver *uadr, opcua_poll_group *group)
+{
+  opcua_connection *conn = group->conn;
+  UA_ReadRequest request;
+  UA_StatusCode retval;
+
+  if (atomic_load(&group->retired))
+    return;
+  if (atomic_load(&conn->state) != OPCUA_CONN_UP ||
+    atomic_exchange(&group->in_flight, true))
+  {
+    atomic_fetch_add(&uadr->metrics.polls_skipped, 1);
+    return;
+  }
+
+  UA_ReadRequest_init(&request);
+  request.nodesToRead = group->ids;
+  request.nodesToReadSize = group->nres;
+  request.timestampsToReturn = UA_TIMESTAMPSTORETURN_BOTH;
+
+  pthread_mutex_lock(&conn->mutex);
+  retval = __UA_Client_AsyncService(conn->client, &request,
+    &UA_TYPES[UA_TYPES_READREQUEST], poll_complete,
+    &UA_TYPES[UA_TYPES_READRESPONSE], group, NULL);
+  opcua_conn_unlock(conn);
+
+  atomic_fetch_add(&uadr->metrics.polls, 1);
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    iot_log_warning(uadr->lc, "Failed to poll %s. Status Code: %s",
+      conn->endpoint, UA_StatusCode_name(retval));
+    atomic_fetch_add(&uadr->metrics.poll_failures, 1);
+    atomic_store(&group->in_flight, false);
+  }
+}
+
+/*
+ * Post the readings of one device's part of a completed poll. The resources
+ * of each command made up of them are posted as one event, provided they
+ * were all read; the rest are posted individually.
+ */
+static void poll_device_post(opcua_driver *uadr, opcua_poll_group *group,
+  const poll_device *pd, edgex_device_commandresult *values,
+  const bool *valid, opcua_arena *arena)
+{
+  bool *posted = opcua_arena_alloc(arena, pd->nres * sizeof(bool));
+
+  values += pd->start;
+  valid += pd->start;
+  memset(posted, 0, pd->nres * sizeof(bool));
+  for (poll_command *cmd = pd->commands; cmd; cmd = cmd->next)
+  {
+    edgex_device_commandresult *cmdvalues;
+    bool complete = true;
+
+    for (uint32_t j = 0; j < cmd->nres && complete; j++)
+      complete = valid[cmd->index[j]];
+    if (!complete)
+      continue;
+    cmdvalues = opcua_arena_alloc(arena,
+      cmd->nres * sizeof(edgex_device_commandresult));
+    for (uint32_t j = 0; j < cmd->nres; j++)
+    {
+      cmdvalues[j] = values[cmd->index[j]];
+      posted[cmd->index[j]] = true;
+    }
+    uadr->ops.post_readings(uadr->ops.ctx, pd->devname, cmd->command,
+      cmd->nres, cmdvalues);
+    atomic_fetch_add(&uadr->metrics.poll_readings, cmd->nres);
+  }
+  for (uint32_t i = 0; i < pd->nres; i++)
+  {
+    if (valid[i] && !posted[i])
+    {
+      uadr->ops.post_readings(uadr->ops.ctx, pd->devname,
+        group->names[pd->start + i], 1, &values[i]);
+      atomic_fetch_add(&uadr->metrics.poll_readings, 1);
+    }
+  }
+}
+
+/* Post the readings of a completed poll, unless the group has been replaced */
+static void poll_group_post(opcua_driver *uadr, opcua_poll_group *group,
+  opcua_arena *arena)
+{
+  UA_ReadResponse *response = &group->response;
+  edgex_device_commandresult *values;
+  bool *valid;
+
+  if (atomic_load(&group->retired))
+    goto done;
+  if (response->responseHeader.serviceResult != UA_STATUSCODE_GOOD ||
+    response->resultsSize != group->nres)
+  {
+    iot_log_warning(uadr->lc, "Failed to poll %s. Status Code: %s",
+      group->conn->endpoint,
+      UA_StatusCode_name(response->responseHeader.serviceResult));
+    atomic_fetch_add(&uadr->metrics.poll_failures, 1);
+    goto done;
+  }
+
+  values = opcua_arena_alloc(arena,
+    group->nres * sizeof(edgex_device_commandresult));
+  valid = opcua_arena_alloc(arena, group->nres * sizeof(bool));
+  for (uint32_t i = 0; i < group->nres; i++)
+  {
+    UA_DataValue *dv = &response->results[i];
+    valid[i] = dv->hasValue &&
+      (!dv->hasStatus || dv->status == UA_STATUSCODE_GOOD);
+    if (!valid[i])
+    {
+      iot_log_debug(uadr->lc, "Failed to poll %s on %s", group->names[i],
+        group->conn->endpoint);
+      continue;
+    }
+    values[i] = opcua_to_edgex(&dv->value, uadr->lc, arena);
+    values[i].origin = opcua_origin(dv);
+  }
+  for (uint32_t d = 0; d < group->ndevices; d++)
+    poll_device_post(uadr, group, &group->devices[d], values, valid, arena);
+
+done:
+  UA_ReadResponse_deleteMembers(response);
+  UA_ReadResponse_init(response);
+  atomic_store(&group->in_flight, false);
+}
+
+static void free_poll_group(opcua_poll_group *group)
+{
+  for (uint32_t d = 0; d < group->ndevices; d++)
+  {
+    poll_device *pd = &group->devices[d];
+    while (pd->commands)
+    {
+      poll_command *cmd = pd->commands;
+      pd->commands = cmd->next;
+      free(cmd->command);
+      free(cmd->index);
+      free(cmd);
+    }
+    free(pd->grouped);
+    free(pd->devname);
+  }
+  for (uint32_t i = 0; i < group->nres; i++)
+  {
+    free(group->names[i]);
+    opcua_resource_release(group->res[i]);
+  }
+  UA_ReadResponse_deleteMembers(&group->response);
+  free(group->names);
+  free(group->res);
+  free(group->ids);
+  free(group->devices);
+  free(group);
+}
+
+/*
+ * Advance the wheel to the present, rescheduling the groups which fall due
+ * and returning them. Retired groups drop out of the wheel instead. Caller
+ * holds the poller mutex.
+ */
+static opcua_poll_group *poller_expire(opcua_poller *poller, uint64_t now)
+{
+  opcua_poll_group *due = NULL;
+
+  while (now >= poller->next_tick)
+  {
+    opcua_wheel_entry *entry = opcua_wheel_advance(&poller->wheel);
+    while (entry)
+    {
+      opcua_poll_group *group = (opcua_poll_group *)entry;
+      entry = entry->next;
+      if (atomic_load(&group->retired))
+      {
+        group->scheduled = false;
+        continue;
+      }
+      opcua_wheel_add(&poller->wheel, &group->entry, group->ticks);
+      if (!group->due)
+      {
+        group->due = true;
+        group->next_due = due;
+        due = group;
+      }
+    }
+    poller->next_tick += poller->tick;
+  }
+  return due;
+}
+
+/*
+ * Free the retired groups which have left the wheel and have no read
+ * outstanding. Only the poller thread sends reads, so neither can change
+ * afterwards. Called by the poller thread with the poller mutex held.
+ */
+static void poller_reap(opcua_poller *poller)
+{
+  opcua_poll_group **pos = &poller->retired;
+
+  while (*pos)
+  {
+    opcua_poll_group *group = *pos;
+    if (!group->scheduled && !atomic_load(&group->in_flight))
+    {
+      *pos = group->next;
+      free_poll_group(group);
+    }
+    else
+    {
+      pos = &group->next;
+    }
+  }
+}
+
+static void *opcua_poller_thread(void *arg)
+{
+  opcua_driver *uadr = (opcua_driver *)arg;
+  opcua_poller *poller = &uadr->poller;
+
+  pthread_mutex_lock(&poller->mutex);
+  while (poller->running)
+  {
+    uint64_t now = opcua_now_ms();
+    bool turning = poller->groups || poller->retired;
+    opcua_poll_group *due;
+    opcua_poll_group *done;
+
+    if (!poller->done && (!turning || now < poller->next_tick))
+    {
+      if (turning)
+      {
+        struct timespec deadline;
+        opcua_deadline(&deadline, (uint32_t)(poller->next_tick - now));
+        pthread_cond_timedwait(&poller->cond, &poller->mutex, &deadline);
+      }
+      else
+      {
+        pthread_cond_wait(&poller->cond, &poller->mutex);
+      }
+      continue;
+    }
+
+    due = turning ? poller_expire(poller, now) : NULL;
+    done = poller->done;
+    poller->done = NULL;
+    pthread_mutex_unlock(&poller->mutex);
+
+    for (; due; due = due->next_due)
+    {
+      due->due = false;
+      poll_group_read(uadr, due);
+    }
+    for (; done; done = done->next_done)
+      poll_group_post(uadr, done, &poller->arena);
+    opcua_arena_reset(&poller->arena);
+
+    pthread_mutex_lock(&poller->mutex);
+    poller_reap(poller);
+  }
+  pthread_mutex_unlock(&poller->mutex);
+  return NULL;
+}
+
+static void opcua_poller_start(opcua_driver *uadr, uint32_t tick)
+{
+  opcua_poller *poller = &uadr->poller;
+
+  pthread_mutex_init(&poller->mutex, NULL);
+  pthread_mutex_init(&poller->setup_mutex, NULL);
+  pthread_cond_init(&poller->cond, NULL);
+  opcua_wheel_init(&poller->wheel, OPCUA_WHEEL_SLOTS);
+  opcua_arena_init(&poller->arena);
+  poller->tick = tick ? tick : 1;
+  poller->running = true;
+  pthread_create(&poller->thread, NULL, opcua_poller_thread, uadr);
+}
+
+static void opcua_poller_stop(opcua_driver *uadr)
+{
+  opcua_poller *poller = &uadr->poller;
+
+  pthread_mutex_lock(&poller->mutex);
+  poller->running = false;
+  pthread_cond_signal(&poller->cond);
+  pthread_mutex_unlock(&poller->mutex);
+  pthread_join(poller->thread, NULL);
+}
+
+/*
+ * Free the poll groups once their connections are gone, so no more reads
+ * can complete.
+ */
+static void opcua_poller_free(opcua_driver *uadr)
+{
+  opcua_poller *poller = &uadr->poller;
+
+  while (poller->groups)
+  {
+    opcua_poll_group *group = poller->groups;
+    poller->groups = group->next;
+    free_poll_group(group);
+  }
+  while (poller->retired)
+  {
+    opcua_poll_group *group = poller->retired;
+    poller->retired = group->next;
+    free_poll_group(group);
+  }
+  opcua_arena_fini(&poller->arena);
+  opcua_wheel_fini(&poller->wheel);
+  pthread_cond_destroy(&poller->cond);
+  pthread_mutex_destroy(&poller->setup_mutex);
+  pthread_mutex_destroy(&poller->mutex);
+}
+
+/* Index of a resource in a device's part of a group, nres if absent */
+static uint32_t poll_device_index(const opcua_poll_group *group,
+  const poll_device *pd, const char *name)
+{
+  uint32_t i = 0;
+  while (i < pd->nres && strcmp(group->names[pd->start + i], name))
+    i++;
+  return i;
+}
+
+/*
+ * Look for device commands made up only of resources of a device's part of
+ * a group, so that their readings can be posted as a single event.
+ */
+static void setup_poll_commands(const opcua_poll_group *group,
+  poll_device *pd, const edgex_deviceprofile *profile)
+{
+  for (const edgex_profileresource *pr = profile->profile_resources; pr;
+    pr = pr->next)
+  {
+    uint32_t nres = 0;
+    bool usable = (pr->get != NULL);
+    poll_command *cmd;
+
+    for (const edgex_resourceoperation *ro = pr->get; ro && usable;
+      ro = ro->next, nres++)
+    {
+      uint32_t i = poll_device_index(group, pd, ro->object);
+      usable = (i < pd->nres && !pd->grouped[i]);
+    }
+    if (!usable)
+      continue;
+
+    cmd = malloc(sizeof(poll_command));
+    cmd->command = strdup(pr->name);
+    cmd->nres = nres;
+    cmd->index = calloc(nres, sizeof(uint32_t));
+    nres = 0;
+    for (const edgex_resourceoperation *ro = pr->get; ro; ro = ro->next)
+    {
+      uint32_t i = poll_device_index(group, pd, ro->object);
+      cmd->index[nres++] = i;
+      pd->grouped[i] = true;
+    }
+    cmd->next = pd->commands;
+    pd->commands = cmd;
+  }
+}
+
+/* A polled resource of a connection, collected when setting up polling */
+typedef struct polled_resource
+{
+  /* Index of the device among those collected */
+  uint32_t device;
+  /* Position in the device's profile */
+  uint32_t order;
+  const char *name;
+  opcua_resource *res;
+} polled_resource;
+
+/* Order by interval, then device, keeping each profile's order */
+static int compare_polled(const void *a, const void *b)
+{
+  const polled_resource *pa = (const polled_resource *)a;
+  const polled_resource *pb = (const polled_resource *)b;
+
+  if (pa->res->pollInterval != pb->res->pollInterval)
+    return (pa->res->pollInterval > pb->res->pollInterval) ? 1 : -1;
+  if (pa->device != pb->device)
+    return (pa->device > pb->device) ? 1 : -1;
+  return (pa->order > pb->order) - (pa->order < pb->order);
+}
+
+/*
+ * Make the group of a run of polled resources sharing an interval, with a
+ * part for each device, taking over their references.
+ */
+static opcua_poll_group *make_poll_group(opcua_driver *uadr,
+  opcua_connection *conn, const polled_resource *polled, uint32_t n,
+  edgex_device **devices)
+{
+  opcua_poller *poller = &uadr->poller;
+  opcua_poll_group *group = malloc(sizeof(opcua_poll_group));
+  uint32_t interval = polled[0].res->pollInterval;
+
+  memset(group, 0, sizeof(opcua_poll_group));
+  group->conn = conn;
+  group->interval = interval;
+  group->ticks = (interval + poller->tick / 2) / poller->tick;
+  if (group->ticks == 0)
+    group->ticks = 1;
+  group->nres = n;
+  group->names = calloc(n, sizeof(char *));
+  group->res = calloc(n, sizeof(opcua_resource *));
+  group->ids = calloc(n, sizeof(UA_ReadValueId));
+  for (uint32_t i = 0; i < n; i++)
+  {
+    group->names[i] = strdup(polled[i].name);
+    group->res[i] = polled[i].res;
+    UA_ReadValueId_init(&group->ids[i]);
+    group->ids[i].nodeId = polled[i].res->nodeId;
+    group->ids[i].attributeId = UA_ATTRIBUTEID_VALUE;
+    if (i == 0 || polled[i].device != polled[i - 1].device)
+      group->ndevices++;
+  }
+  UA_ReadResponse_init(&group->response);
+
+  group->devices = calloc(group->ndevices, sizeof(poll_device));
+  for (uint32_t i = 0, d = 0; i < n; d++)
+  {
+    poll_device *pd = &group->devices[d];
+    edgex_device *device = devices[polled[i].device];
+
+    pd->devname = strdup(device->name);
+    pd->start = i;
+    while (i < n && polled[i].device == polled[pd->start].device)
+      i++;
+    pd->nres = i - pd->start;
+    pd->grouped = calloc(pd->nres, sizeof(bool));
+    setup_poll_commands(group, pd, device->profile);
+  }
+  iot_log_info(uadr->lc,
+    "Polling %u resource(s) of %u device(s) on %s every %ums", n,
+    group->ndevices, conn->endpoint, interval);
+  return group;
+}
+
+/*
+ * (Re)build the poll groups of a connection from the current profiles of
+ * its devices: one group per interval, each read with a single request.
+ * Monitored resources are left to their subscriptions. The groups replace
+ * any the connection had; those are retired, and freed by the poller thread
+ * once it is done with them.
+ */
+static void setup_connection_polling(opcua_driver *uadr,
+  opcua_connection *conn)
+{
+  opcua_poller *poller = &uadr->poller;
+  opcua_device **devs;
+  edgex_device **devices;
+  polled_resource *polled = NULL;
+  uint32_t ndevs = 0;
+  uint32_t npolled = 0;
+  uint32_t size = 0;
+  opcua_poll_group *groups = NULL;
+  bool turning;
+
+  pthread_mutex_lock(&poller->setup_mutex);
+
+  /* Devices are never removed from a connection, nor freed until stop */
+  pthread_mutex_lock(&conn->mutex);
+  for (opcua_device *dev = conn->devices; dev; dev = dev->next)
+    ndevs++;
+  devs = calloc(ndevs ? ndevs : 1, sizeof(opcua_device *));
+  ndevs = 0;
+  for (opcua_device *dev = conn->devices; dev; dev = dev->next)
+    devs[ndevs++] = dev;
+  opcua_conn_unlock(conn);
+
+  devices = calloc(ndevs ? ndevs : 1, sizeof(edgex_device *));
+  for (uint32_t d = 0; d < ndevs; d++)
+  {
+    uint32_t order = 0;
+
+    devices[d] = uadr->ops.get_device(uadr->ops.ctx, devs[d]->devname);
+    if (devices[d] && !devices[d]->profile)
+    {
+      uadr->ops.free_device(uadr->ops.ctx, devices[d]);
+      devices[d] = NULL;
+    }
+    if (!devices[d])
+      continue;
+
+    for (edgex_deviceresource *resource =
+      devices[d]->profile->device_resources; resource;
+      resource = resource->next, order++)
+    {
+      opcua_resource *res = opcua_get_device_resource(&uadr->resources,
+        devs[d]->devname, resource);
+      if (!res->pollInterval || res->monitored)
+      {
+        opcua_resource_release(res);
+        continue;
+      }
+      if (npolled == size)
+      {
+        size = size ? size * 2 : 16;
+        polled = realloc(polled, size * sizeof(polled_resource));
+      }
+      polled[npolled].device = d;
+      polled[npolled].order = order;
+      polled[npolled].name = resource->name;
+      polled[npolled++].res = res;
+    }
+  }
+  qsort(polled, npolled, sizeof(polled_resource), compare_polled);
+
+  for (uint32_t i = 0; i < npolled;)
+  {
+    uint32_t n = 1;
+    opcua_poll_group *group;
+
+    while (i + n < npolled &&
+      polled[i + n].res->pollInterval == polled[i].res->pollInterval)
+    {
+      n++;
+    }
+    group = make_poll_group(uadr, conn, &polled[i], n, devices);
+    group->next = groups;
+    groups = group;
+    i += n;
+  }
+
+  /* Swap the new groups in for the connection's old ones */
+  pthread_mutex_lock(&poller->mutex);
+  turning = poller->groups || poller->retired;
+  for (opcua_poll_group **pos = &poller->groups; *pos;)
+  {
+    opcua_poll_group *group = *pos;
+    if (group->conn != conn)
+    {
+      pos = &group->next;
+      continue;
+    }
+    *pos = group->next;
+    atomic_store(&group->retired, true);
+    group->next = poller->retired;
+    poller->retired = group;
+  }
+  if (groups && !turning)
+    poller->next_tick = opcua_now_ms() + poller->tick;
+  while (groups)
+  {
+    opcua_poll_group *group = groups;
+    groups = group->next;
+    opcua_wheel_add(&poller->wheel, &group->entry, group->ticks);
+    group->scheduled = true;
+    group->next = poller->groups;
+    poller->groups = group;
+  }
+  pthread_cond_signal(&poller->cond);
+  pthread_mutex_unlock(&poller->mutex);
+
+  for (uint32_t d = 0; d < ndevs; d++)
+  {
+    if (devices[d])
+      uadr->ops.free_device(uadr->ops.ctx, devices[d]);
+  }
+  free(devices);
+  free(devs);
+  free(polled);
+  pthread_mutex_unlock(&poller->setup_mutex);
+}
+
+/*
+ * Add a device to a connection which is already in use. If the session is up
+ * the device's subscriptions are created on it now, otherwise they are
+ * created with those of the other devices when it is re-established. The
+ * connection's polling is rebuilt to take in the device's polled resources.
+ */
+static void opcua_attach_device(opcua_driver *uadr, opcua_connection *conn,
+  const char *devname)
+{
+  opcua_device *dev;
+
+  pthread_mutex_lock(&conn->mutex);
+  pthread_rwlock_wrlock(&uadr->conn_lock);
+  dev = opcua_map_get(&uadr->devices, devname);
+  if (!dev)
+  {
+    dev = malloc(sizeof(opcua_device));
+    dev->devname = strdup(devname);
+    dev->conn = conn;
+    dev->resubscribe = false;
+    opcua_latency_init(&dev->latency);
+    dev->next = conn->devices;
+    conn->devices = dev;
+    opcua_map_put(&uadr->devices, devname, dev);
+  }
+  else
+  {
+    dev = NULL;
+  }
+  pthread_rwlock_unlock(&uadr->conn_lock);
+
+  if (dev)
+  {
+    iot_log_info(uadr->lc, "Sharing OPC-UA connection {%s} with device {%s}",
+      conn->endpoint, devname);
+    if (UA_Client_getState(conn->client) >= UA_CLIENTSTATE_SESSION)
+    {
+      setup_device_subscriptions(conn->client,
+        (client_context *)UA_Client_getContext(conn->client), dev);
+    }
+  }
+  opcua_conn_unlock(conn);
+
+  if (dev)
+    setup_connection_polling(uadr, conn);
+}
+
+/* Looks for the opcua_connection serving a device. Devices whose protocol
+ * properties give the same endpoint share a connection. If an existing
+ * connection is not found a new connection is created and connected.
+ * Returns the opcua_connection, which may be connecting or down
+ */
+static opcua_connection *find_opcua_connection(opcua_driver *uadr,
+  const char *devname, edgex_protocols *protocol)
+{
+  opcua_device *dev;
+  opcua_connection *conn;
+  opcua_connection *curr;
+  char *endpoint;
+
+  /* Check if the device already has a connection */
+  pthread_rwlock_rdlock(&uadr->conn_lock);
+  dev = opcua_map_get(&uadr->devices, devname);
+  pthread_rwlock_unlock(&uadr->conn_lock);
+  if (dev)
+  {
+    iot_log_debug(uadr->lc, "Found Existing opcua_connection: %s",
+      dev->conn->addr_id);
+    return dev->conn;
+  }
+
+  endpoint = opcua_endpoint(uadr, protocol);
+  if (!endpoint)
+    return NULL;
+
+  /* Check if another device has connected to the endpoint */
+  pthread_rwlock_rdlock(&uadr->conn_lock);
+  curr = opcua_map_get(&uadr->connections, endpoint);
+  pthread_rwlock_unlock(&uadr->conn_lock);
+  if (curr)
+  {
+    free(endpoint);
+    opcua_attach_device(uadr, curr, devname);
+    return curr;
+  }
+
+  /* If no connection to the endpoint is found, create one */
+  conn = create_opcua_connection(uadr, devname, endpoint);
+  if (!conn)
+    return NULL;
+
+  /*
+   * Publish the connection before connecting, so that concurrent requests
+   * wait on this connect. Another request may have got in first, keep its.
+   */
+  pthread_rwlock_wrlock(&uadr->conn_lock);
+  curr = opcua_map_get(&uadr->connections, conn->addr_id);
+  if (!curr)
+  {
+    opcua_map_put(&uadr->connections, conn->addr_id, conn);
+    opcua_map_put(&uadr->devices, devname, conn->devices);
+  }
+  pthread_rwlock_unlock(&uadr->conn_lock);
+
+  if (curr)
+  {
+    iot_log_debug(uadr->lc, "Discarding duplicate opcua_connection: %s",
+      conn->addr_id);
+    free_connection(conn);
+    opcua_attach_device(uadr, curr, devname);
+    return curr;
+  }
+
+  iot_log_info(uadr->lc,
+    "Creating new OPC-UA connection at endpoint {%s} for device {%s}",
+    conn->endpoint, devname);
+  opcua_first_connect(uadr, conn);
+  opcua_loop_add(uadr, conn);
+  setup_connection_polling(uadr, conn);
+  return conn;
+}
+
+static void dump_protocols(iot_logger_t *lc, const edgex_protocols *prots)
+{
+  for (const edgex_protocols *p = prots; p; p = p->next)
+  {
+    iot_log_debug(lc, " [%s] protocol:", p->name);
+    for (const edgex_nvpairs *nv = p->properties; nv; nv = nv->next)
+    {
+      iot_log_debug (lc, "    %s = %s", nv->name, nv->value);
+    }
+  }
+}
+
+/* Read an unsigned integer option from the [Driver] configuration */
+static uint32_t get_config_uint(iot_logger_t *lc, const edgex_nvpairs *config,
+  const char *name, uint32_t dflt)
+{
+  for (const edgex_nvpairs *nv = config; nv; nv = nv->next)
+  {
+    if (strcmp(nv->name, name) == 0)
+    {
+      char *end;
+      unsigned long val = strtoul(nv->value, &end, 10);
+      if (end == nv->value || *end != '\0')
+      {
+        iot_log_warning(lc, "Invalid value %s for %s, using %u", nv->value,
+          name, dflt);
+        return dflt;
+      }
+      return (uint32_t)val;
+    }
+  }
+  return dflt;
+}
+
+/* Returns a copy of a configuration value, or NULL if it is not set */
+static char *get_config_string(const edgex_nvpairs *config, const char *name)
+{
+  for (const edgex_nvpairs *nv = config; nv; nv = nv->next)
+  {
+    if (strcmp(nv->name, name) == 0)
+      return *nv->value ? strdup(nv->value) : NULL;
+  }
+  return NULL;
+}
+
+static void discovery_configure(opcua_driver *driver,
+  const edgex_nvpairs *config)
+{
+  opcua_discovery_params *params = &driver->discovery_params;
+  iot_logger_t *lc = driver->lc;
+  char *root = get_config_string(config, "DiscoveryRoot");
+  char *namespaces = get_config_string(config, "DiscoveryNamespaces");
+
+  opcua_discovery_init(&driver->discovery);
+  driver->discovery_endpoints = get_config_string(config,
+    "DiscoveryEndpoints");
+  params->dir = get_config_string(config, "DiscoveryDir");
+  params->root = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
+  if (root && !opcua_parse_nodeid_string(root, &params->root))
+  {
+    iot_log_warning(lc, "Invalid value %s for DiscoveryRoot, using i=%u",
+      root, UA_NS0ID_OBJECTSFOLDER);
+  }
+  free(root);
+  params->depth = get_config_uint(lc, config, "DiscoveryDepth",
+    DEFAULT_DISCOVERY_DEPTH);
+  params->batch = get_config_uint(lc, config, "DiscoveryBatchSize",
+    DEFAULT_DISCOVERY_BATCH);
+  if (params->batch == 0)
+    params->batch = 1;
+  params->inflight = get_config_uint(lc, config, "DiscoveryRequests",
+    DEFAULT_DISCOVERY_REQUESTS);
+  if (params->inflight == 0)
+    params->inflight = 1;
+  params->timeout = driver->request_timeout;
+  params->ttl = 1000 * get_config_uint(lc, config, "DiscoveryCacheTime",
+    DEFAULT_DISCOVERY_CACHE_TIME);
+
+  if (namespaces)
+  {
+    char *saveptr = NULL;
+    uint32_t n = 1;
+    for (const char *c = namespaces; *c; c++)
+      n += (*c == ',');
+    driver->discovery_namespaces = calloc(n, sizeof(uint16_t));
+    for (char *ns = strtok_r(namespaces, ",", &saveptr); ns;
+      ns = strtok_r(NULL, ",", &saveptr))
+    {
+      driver->discovery_namespaces[params->nnamespaces++] =
+        (uint16_t)strtoul(ns, NULL, 10);
+    }
+    params->namespaces = driver->discovery_namespaces;
+    free(namespaces);
+  }
+}
+
+/* --- Initialize ---- */
+bool opcua_init(void *impl, struct iot_logger_t *lc,
+  const edgex_nvpairs *config)
+{
+  opcua_driver *driver = (opcua_driver *)impl;
+  uint32_t port;
+  driver->lc = lc;
+  pthread_mutex_init(&driver->mutex, NULL);
+  pthread_rwlock_init(&driver->conn_lock, NULL);
+  opcua_map_init(&driver->connections);
+  opcua_map_init(&driver->devices);
+  opcua_resource_cache_init(&driver->resources);
+  iot_log_info(driver->lc, "Initialising OPC-UA Device Service");
+
+  driver->nloops = get_config_uint(lc, config, "LoopThreads",
+    DEFAULT_LOOP_THREADS);
+  if (driver->nloops == 0)
+    driver->nloops = 1;
+  driver->loop_interval = get_config_uint(lc, config, "LoopInterval",
+    DEFAULT_LOOP_INTERVAL);
+  iot_log_info(driver->lc, "Servicing connections with %u loop thread(s)",
+    driver->nloops);
+  driver->notify_window = get_config_uint(lc, config, "NotificationWindow",
+    DEFAULT_NOTIFY_WINDOW);
+  driver->notify_batch = get_config_uint(lc, config, "NotificationBatchSize",
+    DEFAULT_NOTIFY_BATCH);
+  driver->monitor_batch = get_config_uint(lc, config, "MonitoredItemBatchSize",
+    DEFAULT_MONITOR_BATCH);
+  if (driver->monitor_batch == 0)
+    driver->monitor_batch = 1;
+  driver->request_timeout = get_config_uint(lc, config, "RequestTimeout",
+    DEFAULT_REQUEST_TIMEOUT);
+  driver->reconnect_delay = get_config_uint(lc, config, "ReconnectDelay",
+    DEFAULT_RECONNECT_DELAY);
+  if (driver->reconnect_delay == 0)
+    driver->reconnect_delay = 1;
+  driver->reconnect_max_delay = get_config_uint(lc, config,
+    "ReconnectMaxDelay", DEFAULT_RECONNECT_MAX_DELAY);
+  if (driver->reconnect_max_delay < driver->reconnect_delay)
+    driver->reconnect_max_delay = driver->reconnect_delay;
+  driver->connect_wait = get_config_uint(lc, config, "ConnectWait",
+    DEFAULT_CONNECT_WAIT);
+  driver->metrics_interval = get_config_uint(lc, config, "MetricsInterval",
+    DEFAULT_METRICS_INTERVAL);
+  driver->device_scan = get_config_uint(lc, config, "DeviceScanInterval",
+    DEFAULT_DEVICE_SCAN);
+  discovery_configure(driver, config);
+  opcua_histogram_init(&driver->metrics.get_time);
+  opcua_histogram_init(&driver->metrics.put_time);
+  opcua_histogram_init(&driver->metrics.loop_time);
+  opcua_histogram_init(&driver->metrics.lock_wait);
+  opcua_loops_start(driver);
+  opcua_poller_start(driver,
+    get_config_uint(lc, config, "PollTick", DEFAULT_POLL_TICK));
+  /* Started last, as its device scans make connections and poll groups */
+  opcua_supervisor_start(driver);
+  port = get_config_uint(lc, config, "MetricsPort", DEFAULT_METRICS_PORT);
+  if (port)
+  {
+    char *address = get_config_string(config, "MetricsAddress");
+    driver->exporter = opcua_exporter_start(lc,
+      address ? address : DEFAULT_METRICS_ADDRESS, (uint16_t)port,
+      opcua_collect_metrics, driver);
+    free(address);
+  }
+  return true;
+}
+
+/* ---- Discovery ---- */
+static void add_endpoint(const char *key, void *value, void *arg)
+{
+  opcua_map_put((opcua_map *)arg, key, arg);
+}
+
+static void discover_endpoint(const char *key, void *value, void *arg)
+{
+  opcua_driver *driver = (opcua_driver *)arg;
+  opcua_discover_endpoint(&driver->discovery, driver->lc,
+    &driver->discovery_params, key);
+}
+
+/*
+ * Browse the servers of the configured discovery endpoints and of the
+ * connections in use, writing a profile for each to DiscoveryDir.
+ */
+void opcua_discover(void *impl)
+{
+  opcua_driver *driver = (opcua_driver *)impl;
+  opcua_map endpoints;
+
+  if (!driver->discovery_params.dir)
+  {
+    iot_log_info(driver->lc, "Discovery is disabled, DiscoveryDir is not set");
+    return;
+  }
+
+  opcua_map_init(&endpoints);
+  if (driver->discovery_endpoints)
+  {
+    char *list = strdup(driver->discovery_endpoints);
+    char *saveptr = NULL;
+    for (char *ep = strtok_r(list, ",", &saveptr); ep;
+      ep = strtok_r(NULL, ",", &saveptr))
+    {
+      opcua_map_put(&endpoints, ep, &endpoints);
+    }
+    free(list);
+  }
+  pthread_rwlock_rdlock(&driver->conn_lock);
+  opcua_map_foreach(&driver->connections, add_endpoint, &endpoints);
+  pthread_rwlock_unlock(&driver->conn_lock);
+
+  if (endpoints.count == 0)
+    iot_log_info(driver->lc, "Discovery found no endpoints to browse");
+  opcua_map_foreach(&endpoints, discover_endpoint, driver);
+  opcua_map_fini(&endpoints, NULL);
+}
+
+/*
+ * A service request in flight on a connection. The loop thread servicing the
+ * connection receives the response and completes the call, while the caller
+ * waits on the call's own condition variable.
+ */
+typedef struct opcua_call
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool done;
+  /* Set if the caller gave up waiting, the call is then freed on completion */
+  bool abandoned;
+  const UA_DataType *responseType;
+  void *response;
+} opcua_call;
+
+static void free_call(opcua_call *call)
+{
+  pthread_mutex_destroy(&call->mutex);
+  pthread_cond_destroy(&call->cond);
+  if (call->response)
+    UA_delete(call->response, call->responseType);
+  free(call);
+}
+
+static void opcua_call_complete(UA_Client *client, void *userdata,
+  UA_UInt32 requestId, void *response)
+{
+  opcua_call *call = (opcua_call *)userdata;
+  bool abandoned;
+
+  /* Take over the response, leaving the client an empty one to free */
+  pthread_mutex_lock(&call->mutex);
+  memcpy(call->response, response, call->responseType->memSize);
+  UA_init(response, call->responseType);
+  call->done = true;
+  abandoned = call->abandoned;
+  pthread_cond_signal(&call->cond);
+  pthread_mutex_unlock(&call->mutex);
+
+  if (abandoned)
+    free_call(call);
+}
+
+/*
+ * Issue a service request on a connection and wait for its response. The
+ * connection is only held while the request is sent, so any number of
+ * requests may be in flight on the one session. Returns the service result,
+ * with the response filled in if it is good or came from the server.
+ */
+static UA_StatusCode opcua_call_service(opcua_driver *driver,
+  opcua_connection *conn, const void *request, const UA_DataType *requestType,
+  const UA_DataType *responseType, void *response)
+{
+  UA_StatusCode retval;
+  struct timespec deadline;
+  uint64_t start;
+  int rc = 0;
+  opcua_call *call = malloc(sizeof(opcua_call));
+
+  memset(call, 0, sizeof(opcua_call));
+  pthread_mutex_init(&call->mutex, NULL);
+  pthread_cond_init(&call->cond, NULL);
+  call->responseType = responseType;
+  call->response = UA_new(responseType);
+
+  start = opcua_now_us();
+  pthread_mutex_lock(&conn->mutex);
+  opcua_histogram_record(&driver->metrics.lock_wait,
+    (int64_t)(opcua_now_us() - start));
+  retval = __UA_Client_AsyncService(conn->client, request, requestType,
+    opcua_call_complete, responseType, call, NULL);
+  opcua_conn_unlock(conn);
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    free_call(call);
+    return retval;
+  }
+
+  opcua_deadline(&deadline, driver->request_timeout);
+  pthread_mutex_lock(&call->mutex);
+  while (!call->done && rc == 0)
+    rc = pthread_cond_timedwait(&call->cond, &call->mutex, &deadline);
+  if (!call->done)
+  {
+    call->abandoned = true;
+    pthread_mutex_unlock(&call->mutex);
+    return UA_STATUSCODE_BADTIMEOUT;
+  }
+  pthread_mutex_unlock(&call->mutex);
+
+  memcpy(response, call->response, responseType->memSize);
+  free(call->response);
+  call->response = NULL;
+  free_call(call);
+  return ((UA_ResponseHeader *)response)->serviceResult;
+}
+
+/*
+ * Read all requested nodes with a single Read service call, mapping each
+ * returned UA_DataValue back onto the corresponding reading. Every item is
+ * checked individually so that all failing nodes are reported, not just the
+ * first one.
+ */
+static bool opcua_read_batch(opcua_driver *driver, opcua_connection *conn,
+  const char *devname, uint32_t nreadings, const edgex_device_commandrequest *requests,
+  edgex_device_commandresult *readings)
+{
+  bool ok = true;
+  UA_StatusCode retval;
+  UA_ReadRequest request;
+  UA_ReadResponse response;
+  UA_ReadValueId stack_ids[OPCUA_STACK_NODES];
+  uint32_t stack_index[OPCUA_STACK_NODES];
+  opcua_resource *stack_res[OPCUA_STACK_NODES];
+  UA_ReadValueId *ids = stack_ids;
+  uint32_t *index = stack_index;
+  opcua_resource **res = stack_res;
+  uint32_t nread = 0;
+  uint64_t now = opcua_now_us();
+
+  if (nreadings > OPCUA_STACK_NODES)
+  {
+    ids = calloc(nreadings, sizeof(UA_ReadValueId));
+    index = calloc(nreadings, sizeof(uint32_t));
+    res = calloc(nreadings, sizeof(opcua_resource *));
+  }
+
+  /*
+   * Answer what we can from the values notified for monitored resources,
+   * and read the rest. index maps each node read to its reading.
+   */
+  memset(readings, 0, nreadings * sizeof(edgex_device_commandresult));
+  for (uint32_t i = 0; i < nreadings; i++)
+  {
+    uint32_t maxAge;
+    res[i] = opcua_get_resource(&driver->resources, devname, &requests[i]);
+    maxAge = atomic_load(&res[i]->maxAge);
+    if (maxAge &&
+      opcua_last_value_get(&res[i]->last, maxAge, now, &readings[i]))
+    {
+      atomic_fetch_add(&driver->metrics.cached_reads, 1);
+      continue;
+    }
+    UA_ReadValueId_init(&ids[nread]);
+    ids[nread].nodeId = res[i]->nodeId;
+    ids[nread].attributeId = UA_ATTRIBUTEID_VALUE;
+    index[nread++] = i;
+  }
+  if (nread == 0)
+  {
+    iot_log_debug(driver->lc, "All %u readings served from notified values",
+      nreadings);
+    goto done;
+  }
+
+  UA_ReadRequest_init(&request);
+  request.nodesToRead = ids;
+  request.nodesToReadSize = nread;
+  request.timestampsToReturn = UA_TIMESTAMPSTORETURN_NEITHER;
+
+  UA_ReadResponse_init(&response);
+  retval = opcua_call_service(driver, conn, &request,
+    &UA_TYPES[UA_TYPES_READREQUEST], &UA_TYPES[UA_TYPES_READRESPONSE],
+    &response);
+
+  if (retval != UA_STATUSCODE_GOOD)
+  {
+    iot_log_warning(driver->lc,
+                     "Failed to read from OPC-UA server. Status Code: %s",
+                     UA_StatusCode_name(retval));
+    UA_ReadResponse_deleteMembers(&response);
+    ok = false;
+    goto done;
+  }
+  if (response.resultsSize != nread)
+  {
+    iot_log_warning(driver->lc,
+                     "Read returned %zu results for %u requested nodes",
+                     response.resultsSize, nread);
+    UA_ReadResponse_deleteMembers(&response);
+    ok = false;
+    goto done;
+  }
+
+  for (uint32_t j = 0; j < nread; j++)
+  {
+    uint32_t i = index[j];
+    UA_DataValue *dv = &response.results[j];
+    if (dv->hasStatus && dv->status != UA_STATUSCODE_GOOD)
+    {
+      iot_log_warning(driver->lc, "Failed to read %s. Status Code: %s",
+                       requests[i].resname, UA_StatusCode_name(dv->status));
+      ok = false;
+      continue;
+    }
+    if (!dv->hasValue)
+    {
+      iot_log_warning(driver->lc, "No value returned for %s",
+                       requests[i].resname);
+      ok = false;
+      continue;
+    }
+    readings[i] = opcua_to_edgex(&dv->value, driver->lc, NULL);
+  }
+  UA_ReadResponse_deleteMembers(&response);
+
+done:
+  /* The node ids belong to the resources, only free the arrays */
+  for (uint32_t i = 0; i < nreadings; i++)
+    opcua_resource_release(res[i]);
+  if (ids != stack_ids)
+  {
+    free(ids);
+    free(index);
+    free(res);
+  }
+
+  /* The command fails as a whole, so release anything already converted */
+  if (!ok)
+  {
+    for (uint32_t i = 0; i < nreadings; i++)
+    {
+      if (readings[i].type == String)
+      {
+        free(readings[i].value.string_result);
+        readings[i].value.string_result = NULL;
+      }
+      else if (readings[i].type == Binary)
+      {
+        free(readings[i].value.binary_result.bytes);
+        readings[i].value.binary_result.bytes = NULL;
+      }
+    }
+  }
+  return ok;
+}
+
+/* ---- Get ---- */
+static bool opcua_get(void *impl, const char *devname,
+  const edgex_protocols *protocols, uint32_t nreadings,
+  const edgex_device_commandrequest *requests,
+  edgex_device_commandresult *readings)
+{
+  opcua_driver *driver = (opcua_driver *)impl;
+  iot_log_debug(driver->lc, "GET on address:");
+  dump_protocols(driver->lc, protocols);
+
+  /* Find the device's connection or create a new one */
+  opcua_connection *conn =
+    find_opcua_connection(driver, devname, (edgex_protocols *)protocols);
+
+  /* Test the resulting connection, NULL if we failed to create it */
+  if (!conn)
+  {
+    iot_log_warning(driver->lc, "Failed to connect to endpoint: %s", devname);
+    return false;
+  }
+  else
+  {
+    /* Check the state of the client, waiting on a connect in progress */
+    if (opcua_wait_connected(driver, conn))
+    {
+      bool ok;
+      iot_log_debug(driver->lc, "Get nreadings: %d", nreadings);
+      ok = opcua_read_batch(driver, conn, devname, nreadings, requests,
+        readings);
+      opcua_check_changes(driver);
+      return ok;
+    }
+    else
+    {
+      iot_log_error(driver->lc, "Endpoint %s no longer contactable", devname);
+      return false;
+    }
+  }
+}
+
+/*
+ * Write all supplied values with a single Write service call and report the
+ * status code returned for each node.
+ */
+static bool opcua_write_batch(opcua_driver *driver, opcua_connection *conn,
+  const char *devname, uint32_t nvalues, const edgex_device_commandrequest *requests,
+  const edgex_device_commandresult *values)
+{
+  bool ok = true;
+  UA_StatusCode retval;
+  UA_WriteRequest request;
+  UA_WriteResponse response;
+  UA_WriteValue stack_wvs[OPCUA_STACK_NODES];
+  UA_String stack_strings[OPCUA_STACK_NODES];
+  opcua_resource *stack_res[OPCUA_STACK_NODES];
+  UA_WriteValue *wvs = stack_wvs;
+  UA_String *strings = stack_strings;
+  opcua_resource **res = stack_res;
+  uint32_t nres = 0;
+
+  /* The values are written in place, as is any string */
+  if (nvalues > OPCUA_STACK_NODES)
+  {
+    wvs = calloc(nvalues, sizeof(UA_WriteValue));
+    strings = calloc(nvalues, sizeof(UA_String));
+    res = calloc(nvalues, sizeof(opcua_resource *));
+  }
+
+  for (uint32_t i = 0; i < nvalues; i++)
+  {
+    res[nres] = opcua_get_resource(&driver->resources, devname, &requests[i]);
+    UA_WriteValue_init(&wvs[i]);
+    wvs[i].nodeId = res[nres]->nodeId;
+    wvs[i].attributeId = UA_ATTRIBUTEID_VALUE;
+    if (!edgex_to_opcua(&values[i], res[nres++]->arrayType,
+      &wvs[i].value.value, &strings[i], driver->lc))
+    {
+      iot_log_warning(driver->lc, "Unable to convert value for %s",
+                       requests[i].resname);
+      ok = false;
+      break;
+    }
+    wvs[i].value.hasValue = true;
+  }
+
+  if (ok)
+  {
+    UA_WriteRequest_init(&request);
+    request.nodesToWrite = wvs;
+    request.nodesToWriteSize = nvalues;
+
+    UA_WriteResponse_init(&response);
+    retval = opcua_call_service(driver, conn, &request,
+      &UA_TYPES[UA_TYPES_WRITEREQUEST], &UA_TYPES[UA_TYPES_WRITERESPONSE],
+      &response);
+
+    if (retval != UA_STATUSCODE_GOOD)
+    {
+      iot_log_warning(driver->lc, "OPCUA Write Failed. Status Code: %s",
+                       UA_StatusCode_name(retval));
+      ok = false;
+    }
+    else if (response.resultsSize != nvalues)
+    {
+      iot_log_warning(driver->lc,
+                       "Write returned %zu results for %u requested nodes",
+                       response.resultsSize, nvalues);
+      ok = false;
+    }
+    else
+    {
+      for (uint32_t i = 0; i < nvalues; i++)
+      {
+        if (response.results[i] != UA_STATUSCODE_GOOD)
+        {
+          iot_log_warning(driver->lc,
+                           "OPCUA Write of %s Failed. Status Code: %s",
+                           requests[i].resname,
+                           UA_StatusCode_name(response.results[i]));
+          ok = false;
+        }
+      }
+    }
+    UA_WriteResponse_deleteMembers(&response);
+  }
+
+  /* The node ids belong to the resources and the values to the caller */
+  for (uint32_t i = 0; i < nres; i++)
+    opcua_resource_release(res[i]);
+  if (wvs != stack_wvs)
+  {
+    free(wvs);
+    free(strings);
+    free(res);
+  }
+  return ok;
+}
+
+/* ---- Put ---- */
+static bool opcua_put(void *impl, const char *devname,
+    const edgex_protocols *protocols, uint32_t nvalues,
+    const edgex_device_commandrequest *requests,
+    const edgex_device_commandresult *values)
+{
+  opcua_driver *driver = (opcua_driver *)impl;
+  iot_log_debug(driver->lc, "PUT on address:");
+  dump_protocols(driver->lc, protocols);
+
+  /* Find the device's connection or create a new one */
+  opcua_connection *conn =
+    find_opcua_connection(driver, devname, (edgex_protocols *)protocols);
+
+  /* Test the resulting connection, NULL if we failed to create it */
+  if (!conn)
+  {
+    iot_log_warning(driver->lc, "Failed to connect to endpoint: %s", devname);
+    return false;
+  }
+  else
+  {
+    /* Check the state of the client, waiting on a connect in progress */
+    if (opcua_wait_connected(driver, conn))
+    {
+      bool ok = opcua_write_batch(driver, conn, devname, nvalues, requests,
+        values);
+      opcua_check_changes(driver);
+      return ok;
+    }
+    else
+    {
+      iot_log_error(driver->lc, "Endpoint %s no longer contactable", devname);
+      return false;
+    }
+  }
+}
+
+bool opcua_get_handler(void *impl, const char *devname,
+  const edgex_protocols *protocols, uint32_t nreadings,
+  const edgex_device_commandrequest *requests,
+  edgex_device_commandresult *readings)
+{
+  opcua_driver *driver = (opcua_driver *)impl;
+  uint64_t start = opcua_now_us();
+  bool ok = opcua_get(impl, devname, protocols, nreadings, requests, readings);
+
+  atomic_fetch_add(&driver->metrics.gets, 1);
+  if (!ok)
+    atomic_fetch_add(&driver->metrics.get_failures, 1);
+  opcua_histogram_record(&driver->metrics.get_time,
+    (int64_t)(opcua_now_us() - start));
+  return ok;
+}
+
+bool opcua_put_handler(void *impl, const char *devname,
+    const edgex_protocols *protocols, uint32_t nvalues,
+    const edgex_device_commandrequest *requests,
+    const edgex_device_commandresult *values)
+{
+  opcua_driver *driver = (opcua_driver *)impl;
+  uint64_t start = opcua_now_us();
+  bool ok = opcua_put(impl, devname, protocols, nvalues, requests, values);
+
+  atomic_fetch_add(&driver->metrics.puts, 1);
+  if (!ok)
+    atomic_fetch_add(&driver->metrics.put_failures, 1);
+  opcua_histogram_record(&driver->metrics.put_time,
+    (int64_t)(opcua_now_us() - start));
+  return ok;
+}
+
+/* ---- Disconnect ---- */
+bool opcua_disconnect(void *impl, edgex_protocols *protocols)
+{
+  return true;
+}
+
+/* ---- Metrics ---- */
+static void log_device_latency(const char *key, void *value, void *arg)
+{
+  opcua_driver *driver = (opcua_driver *)arg;
+  opcua_device *dev = (opcua_device *)value;
+
+  opcua_latency_log(driver->lc, dev->devname, &dev->latency);
+}
+
+/* Format a label, escaped as the exposition format requires */
+static void format_label(char *label, size_t size, const char *name,
+  const char *value)
+{
+  size_t n = (size_t)snprintf(label, size, "%s=\"", name);
+
+  for (; *value && n + 3 < size; value++)
+  {
+    if (*value == '\\' || *value == '"')
+      label[n++] = '\\';
+    else if (*value == '\n')
+    {
+      label[n++] = '\\';
+      label[n++] = 'n';
+      continue;
+    }
+    label[n++] = *value;
+  }
+  label[n++] = '"';
+  label[n] = '\0';
+}
+
+static void collect_connection_up(const char *key, void *value, void *arg)
+{
+  opcua_metrics_buf *buf = (opcua_metrics_buf *)arg;
+  opcua_connection *conn = (opcua_connection *)value;
+  char label[256];
+
+  format_label(label, sizeof(label), "endpoint", conn->endpoint);
+  opcua_metrics_sample(buf, "opcua_connection_up", label,
+    atomic_load(&conn->state) == OPCUA_CONN_UP);
+}
+
+static void collect_connection_reconnects(const char *key, void *value,
+  void *arg)
+{
+  opcua_metrics_buf *buf = (opcua_metrics_buf *)arg;
+  opcua_connection *conn = (opcua_connection *)value;
+  char label[256];
+  int reconnects;
+
+  pthread_mutex_lock(&conn->state_mutex);
+  reconnects = conn->reconnect_count;
+  pthread_mutex_unlock(&conn->state_mutex);
+
+  format_label(label, sizeof(label), "endpoint", conn->endpoint);
+  opcua_metrics_sample(buf, "opcua_connection_reconnects_total", label,
+    (uint64_t)reconnects);
+}
+
+/* The latency family to write, selected by offset into opcua_latency */
+typedef struct latency_family
+{
+  opcua_metrics_buf *buf;
+  const char *name;
+  size_t offset;
+} latency_family;
+
+static void collect_device_latency(const char *key, void *value, void *arg)
+{
+  latency_family *family = (latency_family *)arg;
+  opcua_device *dev = (opcua_device *)value;
+  char label[256];
+
+  format_label(label, sizeof(label), "device", dev->devname);
+  opcua_metrics_histogram(family->buf, family->name, label,
+    (const opcua_histogram *)((const char *)&dev->latency + family->offset));
+}
+
+/* Write the driver's metrics for a scrape of the exporter */
+static void opcua_collect_metrics(opcua_metrics_buf *buf, void *arg)
+{
+  opcua_driver *driver = (opcua_driver *)arg;
+  opcua_driver_metrics *m = &driver->metrics;
+  static const struct
+  {
+    const char *name;
+    const char *help;
+    size_t offset;
+  } latencies[] =
+  {
+    { "opcua_source_server_latency_seconds",
+      "Time from a change being sampled to being timestamped by the server",
+      offsetof(opcua_latency, source_server) },
+    { "opcua_server_receive_latency_seconds",
+      "Time from a change being timestamped by the server to its receipt",
+      offsetof(opcua_latency, server_receive) },
+    { "opcua_receive_post_latency_seconds",
+      "Time from a change being received to being posted to EdgeX",
+      offsetof(opcua_latency, receive_post) }
+  };
+
+  opcua_metrics_header(buf, "opcua_gets_total", "counter",
+    "GET requests handled");
+  opcua_metrics_sample(buf, "opcua_gets_total", NULL, atomic_load(&m->gets));
+  opcua_metrics_header(buf, "opcua_get_failures_total", "counter",
+    "GET requests which failed");
+  opcua_metrics_sample(buf, "opcua_get_failures_total", NULL,
+    atomic_load(&m->get_failures));
+  opcua_metrics_header(buf, "opcua_get_duration_seconds", "histogram",
+    "Time taken to handle a GET request");
+  opcua_metrics_histogram(buf, "opcua_get_duration_seconds", NULL,
+    &m->get_time);
+
+  opcua_metrics_header(buf, "opcua_puts_total", "counter",
+    "PUT requests handled");
+  opcua_metrics_sample(buf, "opcua_puts_total", NULL, atomic_load(&m->puts));
+  opcua_metrics_header(buf, "opcua_put_failures_total", "counter",
+    "PUT requests which failed");
+  opcua_metrics_sample(buf, "opcua_put_failures_total", NULL,
+    atomic_load(&m->put_failures));
+  opcua_metrics_header(buf, "opcua_put_duration_seconds", "histogram",
+    "Time taken to handle a PUT request");
+  opcua_metrics_histogram(buf, "opcua_put_duration_seconds", NULL,
+    &m->put_time);
+
+  opcua_metrics_header(buf, "opcua_unavailable_total", "counter",
+    "Requests refused because their connection was down");
+  opcua_metrics_sample(buf, "opcua_unavailable_total", NULL,
+    atomic_load(&m->unavailable));
+  opcua_metrics_header(buf, "opcua_cached_reads_total", "counter",
+    "Readings answered from the last notified value");
+  opcua_metrics_sample(buf, "opcua_cached_reads_total", NULL,
+    atomic_load(&m->cached_reads));
+  opcua_metrics_header(buf, "opcua_lock_wait_seconds", "histogram",
+    "Time waited for a connection to send a request");
+  opcua_metrics_histogram(buf, "opcua_lock_wait_seconds", NULL, &m->lock_wait);
+
+  opcua_metrics_header(buf, "opcua_notifications_total", "counter",
+    "Monitored item changes received");
+  opcua_metrics_sample(buf, "opcua_notifications_total", NULL,
+    atomic_load(&m->notifications));
+  opcua_metrics_header(buf, "opcua_notifications_posted_total", "counter",
+    "Monitored item changes posted to EdgeX");
+  opcua_metrics_sample(buf, "opcua_notifications_posted_total", NULL,
+    atomic_load(&m->notifications_posted));
+
+  opcua_metrics_header(buf, "opcua_polls_total", "counter",
+    "Batched reads of polled resources sent");
+  opcua_metrics_sample(buf, "opcua_polls_total", NULL,
+    atomic_load(&m->polls));
+  opcua_metrics_header(buf, "opcua_poll_failures_total", "counter",
+    "Batched reads of polled resources which failed");
+  opcua_metrics_sample(buf, "opcua_poll_failures_total", NULL,
+    atomic_load(&m->poll_failures));
+  opcua_metrics_header(buf, "opcua_polls_skipped_total", "counter",
+    "Polls not made as the connection was down or the last was outstanding");
+  opcua_metrics_sample(buf, "opcua_polls_skipped_total", NULL,
+    atomic_load(&m->polls_skipped));
+  opcua_metrics_header(buf, "opcua_poll_readings_total", "counter",
+    "Readings of polled resources posted");
+  opcua_metrics_sample(buf, "opcua_poll_readings_total", NULL,
+    atomic_load(&m->poll_readings));
+  opcua_metrics_header(buf, "opcua_notifications_recovered_total", "counter",
+    "Monitored item changes recovered with Republish after a reconnect");
+  opcua_metrics_sample(buf, "opcua_notifications_recovered_total", NULL,
+    atomic_load(&m->notifications_recovered));
+  opcua_metrics_header(buf, "opcua_notifications_queued", "gauge",
+    "Monitored item changes waiting to be posted");
+  opcua_metrics_sample(buf, "opcua_notifications_queued", NULL,
+    (uint64_t)atomic_load(&m->notifications_queued));
+
+  opcua_metrics_header(buf, "opcua_reconnects_total", "counter",
+    "Reconnect attempts");
+  opcua_metrics_sample(buf, "opcua_reconnects_total", NULL,
+    atomic_load(&m->reconnects));
+  opcua_metrics_header(buf, "opcua_reconnect_failures_total", "counter",
+    "Reconnect attempts which failed");
+  opcua_metrics_sample(buf, "opcua_reconnect_failures_total", NULL,
+    atomic_load(&m->reconnect_failures));
+
+  opcua_metrics_header(buf, "opcua_loop_runs_total", "counter",
+    "Iterations of the clients by the loop threads");
+  opcua_metrics_sample(buf, "opcua_loop_runs_total", NULL,
+    atomic_load(&m->loop_runs));
+  opcua_metrics_header(buf, "opcua_loop_run_seconds", "histogram",
+    "Time taken by an iteration of a client, including posting its changes");
+  opcua_metrics_histogram(buf, "opcua_loop_run_seconds", NULL, &m->loop_time);
+
+  pthread_rwlock_rdlock(&driver->conn_lock);
+  opcua_metrics_header(buf, "opcua_connections", "gauge",
+    "Connections to OPC-UA servers");
+  opcua_metrics_sample(buf, "opcua_connections", NULL,
+    driver->connections.count);
+  opcua_metrics_header(buf, "opcua_devices", "gauge",
+    "Devices served by the connections");
+  opcua_metrics_sample(buf, "opcua_devices", NULL, driver->devices.count);
+  /* Each family's samples follow its own header */
+  opcua_metrics_header(buf, "opcua_connection_up", "gauge",
+    "Whether the connection's session is up");
+  opcua_map_foreach(&driver->connections, collect_connection_up, buf);
+  opcua_metrics_header(buf, "opcua_connection_reconnects_total", "counter",
+    "Reconnect attempts of the connection");
+  opcua_map_foreach(&driver->connections, collect_connection_reconnects, buf);
+  for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+  {
+    latency_family family = { buf, latencies[i].name, latencies[i].offset };
+    opcua_metrics_header(buf, latencies[i].name, "histogram",
+      latencies[i].help);
+    opcua_map_foreach(&driver->devices, collect_device_latency, &family);
+  }
+  pthread_rwlock_unlock(&driver->conn_lock);
+}
+
+/* Log the latency histograms of each device, every MetricsInterval seconds */
+void opcua_driver_log_metrics(opcua_driver *driver)
+{
+  uint64_t *last = &driver->metrics.last_logged;
+  uint64_t now = opcua_now_ms();
+
+  if (driver->metrics_interval == 0 || !driver->lc)
+    return;
+  if (*last == 0)
+    *last = now;
+  if (now - *last < (uint64_t)driver->metrics_interval * 1000)
+    return;
+  *last = now;
+
+  pthread_rwlock_rdlock(&driver->conn_lock);
+  opcua_map_foreach(&driver->devices, log_device_latency, driver);
+  pthread_rwlock_unlock(&driver->conn_lock);
+}
+
+/* ---- Stop ---- */
+static void disconnect_connection(const char *key, void *value, void *arg)
+{
+  opcua_driver *driver = (opcua_driver *)arg;
+  opcua_connection *current = (opcua_connection *)value;
+
+  iot_log_debug(driver->lc, "Disconnecting from: %s id: %s",
+    current->endpoint, current->addr_id);
+  UA_Client_disconnect(current->client);
+  iot_log_debug(driver->lc, "Deleting client id: %s", current->addr_id);
+}
+
+
+void opcua_stop(void *impl, bool force)
+{
+  opcua_driver *driver = (opcua_driver *)impl;
+  iot_log_info(driver->lc, "OPCUA Device Service Stopping");
+  opcua_exporter_stop(driver->exporter);
+  driver->exporter = NULL;
+  opcua_supervisor_stop(driver);
+  opcua_poller_stop(driver);
+  opcua_loops_stop(driver);
+  opcua_supervisor_free(driver);
+  pthread_rwlock_wrlock(&driver->conn_lock);
+  opcua_map_foreach(&driver->connections, disconnect_connection, driver);
+  opcua_map_fini(&driver->devices, NULL);
+  opcua_map_fini(&driver->connections, free_connection);
+  pthread_rwlock_unlock(&driver->conn_lock);
+
+  opcua_poller_free(driver);
+  opcua_resource_cache_fini(&driver->resources);
+  opcua_discovery_fini(&driver->discovery);
+  UA_NodeId_deleteMembers(&driver->discovery_params.root);
+  free((char *)driver->discovery_params.dir);
+  free(driver->discovery_namespaces);
+  free(driver->discovery_endpoints);
+}
+
+/* ---- Lifecycle ---- */
+opcua_driver *opcua_driver_new(const opcua_service_ops *ops)
+{
+  opcua_driver *driver = malloc(sizeof(opcua_driver));
+  memset(driver, 0, sizeof(opcua_driver));
+  driver->ops = *ops;
+  return driver;
+}
+
+void opcua_driver_free(opcua_driver *driver)
+{
+  free(driver);
+}
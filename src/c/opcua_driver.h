@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_DRIVER_H_
+#define _OPCUA_DRIVER_H_
+
+#include "edgex/devsdk.h"
+
+typedef struct opcua_driver opcua_driver;
+
+/*
+ * How the driver reaches the device service, to look up devices and to post
+ * the changes of monitored items. The device service goes through the SDK,
+ * the benchmark stands in for it. get_devices returns a list of all the
+ * service's devices, freed with free_device. The values posted remain the
+ * driver's, including any String and Binary data they point to.
+ */
+typedef struct opcua_service_ops
+{
+  edgex_device *(*get_device)(void *ctx, const char *name);
+  edgex_device *(*get_devices)(void *ctx);
+  void (*free_device)(void *ctx, edgex_device *device);
+  void (*post_readings)(void *ctx, const char *devname, const char *resname,
+    uint32_t nvalues, const edgex_device_commandresult *values);
+  void *ctx;
+} opcua_service_ops;
+
+extern opcua_driver *opcua_driver_new(const opcua_service_ops *ops);
+extern void opcua_driver_free(opcua_driver *driver);
+
+/* Logs the per-device latencies, if due. Called periodically */
+extern void opcua_driver_log_metrics(opcua_driver *driver);
+
+/* Device service callbacks, for which impl is the opcua_driver */
+extern bool opcua_init(void *impl, struct iot_logger_t *lc,
+  const edgex_nvpairs *config);
+extern void opcua_discover(void *impl);
+extern bool opcua_get_handler(void *impl, const char *devname,
+  const edgex_protocols *protocols, uint32_t nreadings,
+  const edgex_device_commandrequest *requests,
+  edgex_device_commandresult *readings);
+extern bool opcua_put_handler(void *impl, const char *devname,
+  const edgex_protocols *protocols, uint32_t nvalues,
+  const edgex_device_commandrequest *requests,
+  const edgex_device_commandresult *values);
+extern bool opcua_disconnect(void *impl, edgex_protocols *protocols);
+extern void opcua_stop(void *impl, bool force);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define OPCUA_MAP_INITIAL_BUCKETS 16
+
+/* FNV-1a */
+static uint32_t opcua_map_hash(const char *key)
+{
+  uint32_t hash = 2166136261u;
+  while (*key)
+  {
+    hash ^= (uint8_t)*key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static opcua_map_entry **opcua_map_find(const opcua_map *map,
+  const char *key, uint32_t hash)
+{
+  opcua_map_entry **pos = &map->buckets[hash & (map->nbuckets - 1)];
+  while (*pos && ((*pos)->hash != hash || strcmp((*pos)->key, key)))
+  {
+    pos = &(*pos)->next;
+  }
+  return pos;
+}
+
+static void opcua_map_grow(opcua_map *map)
+{
+  uint32_t nbuckets = map->nbuckets * 2;
+  opcua_map_entry **buckets = calloc(nbuckets, sizeof(opcua_map_entry *));
+
+  for (uint32_t i = 0; i < map->nbuckets; i++)
+  {
+    opcua_map_entry *entry = map->buckets[i];
+    while (entry)
+    {
+      opcua_map_entry *next = entry->next;
+      entry->next = buckets[entry->hash & (nbuckets - 1)];
+      buckets[entry->hash & (nbuckets - 1)] = entry;
+      entry = next;
+    }
+  }
+  free(map->buckets);
+  map->buckets = buckets;
+  map->nbuckets = nbuckets;
+}
+
+void opcua_map_init(opcua_map *map)
+{
+  map->nbuckets = OPCUA_MAP_INITIAL_BUCKETS;
+  map->buckets = calloc(map->nbuckets, sizeof(opcua_map_entry *));
+  map->count = 0;
+}
+
+void opcua_map_fini(opcua_map *map, void (*free_fn)(void *value))
+{
+  for (uint32_t i = 0; i < map->nbuckets; i++)
+  {
+    opcua_map_entry *entry = map->buckets[i];
+    while (entry)
+    {
+      opcua_map_entry *next = entry->next;
+      if (free_fn)
+        free_fn(entry->value);
+      free(entry->key);
+      free(entry);
+      entry = next;
+    }
+  }
+  free(map->buckets);
+  map->buckets = NULL;
+  map->nbuckets = 0;
+  map->count = 0;
+}
+
+void *opcua_map_get(const opcua_map *map, const char *key)
+{
+  opcua_map_entry *entry = *opcua_map_find(map, key, opcua_map_hash(key));
+  return entry ? entry->value : NULL;
+}
+
+void *opcua_map_put(opcua_map *map, const char *key, void *value)
+{
+  uint32_t hash = opcua_map_hash(key);
+  opcua_map_entry **pos = opcua_map_find(map, key, hash);
+  void *old = NULL;
+
+  if (*pos)
+  {
+    old = (*pos)->value;
+    (*pos)->value = value;
+    return old;
+  }
+
+  opcua_map_entry *entry = malloc(sizeof(opcua_map_entry));
+  entry->key = strdup(key);
+  entry->hash = hash;
+  entry->value = value;
+  entry->next = NULL;
+  *pos = entry;
+
+  if (++map->count > map->nbuckets)
+    opcua_map_grow(map);
+  return old;
+}
+
+void *opcua_map_remove(opcua_map *map, const char *key)
+{
+  opcua_map_entry **pos = opcua_map_find(map, key, opcua_map_hash(key));
+  opcua_map_entry *entry = *pos;
+  void *value;
+
+  if (!entry)
+    return NULL;
+
+  *pos = entry->next;
+  value = entry->value;
+  free(entry->key);
+  free(entry);
+  map->count--;
+  return value;
+}
+
+void opcua_map_foreach(const opcua_map *map, opcua_map_fn fn, void *arg)
+{
+  for (uint32_t i = 0; i < map->nbuckets; i++)
+  {
+    for (opcua_map_entry *entry = map->buckets[i]; entry; entry = entry->next)
+    {
+      fn(entry->key, entry->value, arg);
+    }
+  }
+}
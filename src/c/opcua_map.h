@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_MAP_H_
+#define _OPCUA_MAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Simple chained hash map keyed by strings. Keys are copied on insertion,
+ * values are owned by the caller. The map does no locking of its own.
+ */
+
+typedef struct opcua_map_entry
+{
+  char *key;
+  uint32_t hash;
+  void *value;
+  struct opcua_map_entry *next;
+} opcua_map_entry;
+
+typedef struct opcua_map
+{
+  opcua_map_entry **buckets;
+  uint32_t nbuckets;
+  uint32_t count;
+} opcua_map;
+
+typedef void (*opcua_map_fn)(const char *key, void *value, void *arg);
+
+extern void opcua_map_init(opcua_map *map);
+extern void opcua_map_fini(opcua_map *map, void (*free_fn)(void *value));
+
+/* Returns the value stored under key, or NULL if not present */
+extern void *opcua_map_get(const opcua_map *map, const char *key);
+
+/* Stores value under key, returning any value it replaced */
+extern void *opcua_map_put(opcua_map *map, const char *key, void *value);
+
+/* Removes key from the map, returning its value */
+extern void *opcua_map_remove(opcua_map *map, const char *key);
+
+/* Calls fn for each entry. The map must not be modified by fn */
+extern void opcua_map_foreach(const opcua_map *map, opcua_map_fn fn,
+  void *arg);
+
+#endif
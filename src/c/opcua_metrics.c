@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_metrics.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+void opcua_histogram_init(opcua_histogram *hist)
+{
+  for (int i = 0; i < OPCUA_HISTOGRAM_BUCKETS; i++)
+  {
+    atomic_init(&hist->buckets[i], 0);
+  }
+  atomic_init(&hist->count, 0);
+  atomic_init(&hist->sum, 0);
+}
+
+void opcua_histogram_record(opcua_histogram *hist, int64_t usecs)
+{
+  uint64_t value = usecs > 0 ? (uint64_t)usecs : 0;
+  int bucket = 0;
+
+  while (bucket < OPCUA_HISTOGRAM_BUCKETS - 1 && value >= (1ull << bucket))
+  {
+    bucket++;
+  }
+  atomic_fetch_add_explicit(&hist->buckets[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+}
+
+uint64_t opcua_histogram_quantile(const opcua_histogram *hist, double q)
+{
+  uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+  uint64_t rank = (uint64_t)(q * count);
+  uint64_t seen = 0;
+
+  if (count == 0)
+    return 0;
+  for (int i = 0; i < OPCUA_HISTOGRAM_BUCKETS - 1; i++)
+  {
+    seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    if (seen > rank)
+      return 1ull << i;
+  }
+  return UINT64_MAX;
+}
+
+void opcua_latency_init(opcua_latency *latency)
+{
+  opcua_histogram_init(&latency->source_server);
+  opcua_histogram_init(&latency->server_receive);
+  opcua_histogram_init(&latency->receive_post);
+}
+
+void opcua_latency_log(iot_logger_t *lc, const char *devname,
+  const opcua_latency *latency)
+{
+  uint64_t count = atomic_load(&latency->receive_post.count);
+
+  if (count == 0)
+    return;
+  iot_log_info(lc,
+    "Latency of %s (%" PRIu64 " changes), p50/p99 us: source->server %"
+    PRIu64 "/%" PRIu64 ", server->receive %" PRIu64 "/%" PRIu64
+    ", receive->post %" PRIu64 "/%" PRIu64, devname, count,
+    opcua_histogram_quantile(&latency->source_server, 0.5),
+    opcua_histogram_quantile(&latency->source_server, 0.99),
+    opcua_histogram_quantile(&latency->server_receive, 0.5),
+    opcua_histogram_quantile(&latency->server_receive, 0.99),
+    opcua_histogram_quantile(&latency->receive_post, 0.5),
+    opcua_histogram_quantile(&latency->receive_post, 0.99));
+}
+
+void opcua_metrics_printf(opcua_metrics_buf *buf, const char *fmt, ...)
+{
+  va_list args;
+  int n;
+
+  for (;;)
+  {
+    va_start(args, fmt);
+    n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+    va_end(args);
+    if (n < 0)
+      return;
+    if (buf->len + n < buf->size)
+    {
+      buf->len += n;
+      return;
+    }
+    buf->size = (buf->size + n + 1) * 2;
+    buf->data = realloc(buf->data, buf->size);
+  }
+}
+
+void opcua_metrics_header(opcua_metrics_buf *buf, const char *name,
+  const char *type, const char *help)
+{
+  opcua_metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+    type);
+}
+
+void opcua_metrics_sample(opcua_metrics_buf *buf, const char *name,
+  const char *labels, uint64_t value)
+{
+  if (labels)
+    opcua_metrics_printf(buf, "%s{%s} %" PRIu64 "\n", name, labels, value);
+  else
+    opcua_metrics_printf(buf, "%s %" PRIu64 "\n", name, value);
+}
+
+void opcua_metrics_histogram(opcua_metrics_buf *buf, const char *name,
+  const char *labels, const opcua_histogram *hist)
+{
+  const char *sep = labels ? "," : "";
+  uint64_t cumulative = 0;
+
+  if (!labels)
+    labels = "";
+  for (int i = 0; i < OPCUA_HISTOGRAM_BUCKETS - 1; i++)
+  {
+    cumulative += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    opcua_metrics_printf(buf, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name,
+      labels, sep, (double)(1ull << i) / 1e6, cumulative);
+  }
+  cumulative += atomic_load_explicit(
+    &hist->buckets[OPCUA_HISTOGRAM_BUCKETS - 1], memory_order_relaxed);
+  opcua_metrics_printf(buf, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name,
+    labels, sep, cumulative);
+  opcua_metrics_printf(buf, "%s_sum%s%s%s %g\n", name, *sep ? "{" : "",
+    labels, *sep ? "}" : "", (double)atomic_load(&hist->sum) / 1e6);
+  opcua_metrics_printf(buf, "%s_count%s%s%s %" PRIu64 "\n", name,
+    *sep ? "{" : "", labels, *sep ? "}" : "", cumulative);
+}
+
+static void opcua_exporter_serve(opcua_exporter *exporter, int fd,
+  opcua_metrics_buf *buf)
+{
+  char request[1024];
+  char header[128];
+  size_t sent = 0;
+  int n;
+
+  /* The request itself is not looked at, every path returns the metrics */
+  (void)recv(fd, request, sizeof(request), 0);
+
+  buf->len = 0;
+  exporter->collect(buf, exporter->arg);
+
+  n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: %zu\r\n\r\n", buf->len);
+  if (send(fd, header, n, MSG_NOSIGNAL) != n)
+    return;
+  while (sent < buf->len)
+  {
+    ssize_t w = send(fd, buf->data + sent, buf->len - sent, MSG_NOSIGNAL);
+    if (w <= 0)
+      return;
+    sent += w;
+  }
+}
+
+static void *opcua_exporter_thread(void *arg)
+{
+  opcua_exporter *exporter = (opcua_exporter *)arg;
+  opcua_metrics_buf buf = { NULL, 0, 0 };
+  struct pollfd pfd;
+
+  pfd.fd = exporter->fd;
+  pfd.events = POLLIN;
+  while (atomic_load(&exporter->running))
+  {
+    /* Wake periodically to notice being stopped */
+    if (poll(&pfd, 1, 500) <= 0)
+      continue;
+
+    int fd = accept(exporter->fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    struct timeval tv = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    opcua_exporter_serve(exporter, fd, &buf);
+    close(fd);
+  }
+  free(buf.data);
+  return NULL;
+}
+
+opcua_exporter *opcua_exporter_start(iot_logger_t *lc,
+  const char *address, uint16_t port, opcua_metrics_collect collect,
+  void *arg)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+  {
+    iot_log_error(lc, "Invalid metrics address: %s", address);
+    return NULL;
+  }
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    iot_log_error(lc, "Failed to create metrics socket: %s", strerror(errno));
+    return NULL;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+    listen(fd, 8) != 0)
+  {
+    iot_log_error(lc, "Failed to listen for metrics on %s:%u: %s", address,
+      port, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  opcua_exporter *exporter = malloc(sizeof(opcua_exporter));
+  memset(exporter, 0, sizeof(opcua_exporter));
+  exporter->fd = fd;
+  exporter->lc = lc;
+  exporter->collect = collect;
+  exporter->arg = arg;
+  atomic_init(&exporter->running, true);
+  pthread_create(&exporter->thread, NULL, opcua_exporter_thread, exporter);
+  iot_log_info(lc, "Serving metrics on %s:%u", address, port);
+  return exporter;
+}
+
+void opcua_exporter_stop(opcua_exporter *exporter)
+{
+  if (!exporter)
+    return;
+  atomic_store(&exporter->running, false);
+  pthread_join(exporter->thread, NULL);
+  close(exporter->fd);
+  free(exporter);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_METRICS_H_
+#define _OPCUA_METRICS_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "iot/logger.h"
+
+/*
+ * Latency histogram with power of two buckets of microseconds. Bucket i
+ * counts samples below 2^i us, the last bucket everything larger. Samples
+ * are recorded with atomic increments, so recording needs no lock.
+ */
+
+#define OPCUA_HISTOGRAM_BUCKETS 28
+
+typedef struct opcua_histogram
+{
+  atomic_uint_fast64_t buckets[OPCUA_HISTOGRAM_BUCKETS];
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum;
+} opcua_histogram;
+
+/* Latencies of the data changes of a device, from source to EdgeX */
+typedef struct opcua_latency
+{
+  /* Sampled by the device to timestamped by the server */
+  opcua_histogram source_server;
+  /* Timestamped by the server to received by this service */
+  opcua_histogram server_receive;
+  /* Received by this service to posted to EdgeX */
+  opcua_histogram receive_post;
+} opcua_latency;
+
+extern void opcua_histogram_init(opcua_histogram *hist);
+
+/* Records a latency. Negative values, from clock skew, count as zero */
+extern void opcua_histogram_record(opcua_histogram *hist, int64_t usecs);
+
+/* Upper bound of the bucket holding quantile q (0 to 1), in microseconds */
+extern uint64_t opcua_histogram_quantile(const opcua_histogram *hist,
+  double q);
+
+extern void opcua_latency_init(opcua_latency *latency);
+
+/* Logs the median and 99th percentile of each of a device's latencies */
+extern void opcua_latency_log(iot_logger_t *lc, const char *devname,
+  const opcua_latency *latency);
+
+/*
+ * Text in the Prometheus exposition format, built up by a collector each
+ * time the metrics are scraped. Labels are given preformatted, for example
+ * "device=\"Sensor1\"", or NULL for none.
+ */
+
+typedef struct opcua_metrics_buf
+{
+  char *data;
+  size_t len;
+  size_t size;
+} opcua_metrics_buf;
+
+extern void opcua_metrics_printf(opcua_metrics_buf *buf, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/* Writes the HELP and TYPE lines of a metric family */
+extern void opcua_metrics_header(opcua_metrics_buf *buf, const char *name,
+  const char *type, const char *help);
+
+extern void opcua_metrics_sample(opcua_metrics_buf *buf, const char *name,
+  const char *labels, uint64_t value);
+
+/* Writes the bucket, sum and count samples of a histogram, in seconds */
+extern void opcua_metrics_histogram(opcua_metrics_buf *buf, const char *name,
+  const char *labels, const opcua_histogram *hist);
+
+/*
+ * HTTP server answering every request with the output of its collector.
+ * It runs on a thread of its own and serves one scrape at a time.
+ */
+
+typedef void (*opcua_metrics_collect)(opcua_metrics_buf *buf, void *arg);
+
+typedef struct opcua_exporter
+{
+  pthread_t thread;
+  int fd;
+  atomic_bool running;
+  iot_logger_t *lc;
+  opcua_metrics_collect collect;
+  void *arg;
+} opcua_exporter;
+
+/*
+ * Listens on the IPv4 address and port and starts serving. Returns NULL on
+ * failure
+ */
+extern opcua_exporter *opcua_exporter_start(iot_logger_t *lc,
+  const char *address, uint16_t port, opcua_metrics_collect collect,
+  void *arg);
+
+extern void opcua_exporter_stop(opcua_exporter *exporter);
+
+#endif
@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_resource.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UA_SCANF_GUID_DATA(GUID) &(GUID).data1, &(GUID).data2, &(GUID).data3, \
+        &(GUID).data4[0], &(GUID).data4[1], &(GUID).data4[2], &(GUID).data4[3], \
+        &(GUID).data4[4], &(GUID).data4[5], &(GUID).data4[6], &(GUID).data4[7]
+
+/* Element types which may be written from a Binary value */
+static const struct
+{
+  const char *name;
+  int index;
+} opcua_array_types[] =
+{
+  { "Boolean", UA_TYPES_BOOLEAN },
+  { "SByte", UA_TYPES_SBYTE },
+  { "Byte", UA_TYPES_BYTE },
+  { "Int16", UA_TYPES_INT16 },
+  { "UInt16", UA_TYPES_UINT16 },
+  { "Int32", UA_TYPES_INT32 },
+  { "UInt32", UA_TYPES_UINT32 },
+  { "Int64", UA_TYPES_INT64 },
+  { "UInt64", UA_TYPES_UINT64 },
+  { "Float", UA_TYPES_FLOAT },
+  { "Double", UA_TYPES_DOUBLE },
+  { "DateTime", UA_TYPES_DATETIME }
+};
+
+const UA_DataType *opcua_parse_array_type(const char *name)
+{
+  for (size_t i = 0;
+    i < sizeof(opcua_array_types) / sizeof(opcua_array_types[0]); i++)
+  {
+    if (!strcmp(opcua_array_types[i].name, name))
+      return &UA_TYPES[opcua_array_types[i].index];
+  }
+  return NULL;
+}
+
+UA_NodeId opcua_parse_resource(const edgex_nvpairs *attrs,
+  opcua_resource *res)
+{
+  const char *strID = "";
+  const char *nsIndex = "";
+  const char *IDType = "";
+  char * endpt;
+  UA_UInt16 id;
+  UA_NodeId nodeId = UA_NODEID_NULL;
+  const edgex_nvpairs *nvp = attrs;
+  opcua_monitor_params *params = &res->params;
+
+  res->monitored = false;
+  res->arrayType = NULL;
+  params->publishingInterval = -1.0;
+  params->samplingInterval = -1.0;
+  params->queueSize = 0;
+  params->discardOldest = true;
+  params->deadbandType = UA_DEADBANDTYPE_NONE;
+  params->deadbandValue = 0.0;
+  res->maxAge = 0;
+  res->pollInterval = 0;
+
+  while (nvp != NULL)
+  {
+    if (!strcmp(nvp->name, "nodeID"))
+      strID = nvp->value;
+    else if (!strcmp(nvp->name, "nsIndex"))
+      nsIndex = nvp->value;
+    else if (!strcmp(nvp->name, "IDType"))
+      IDType = nvp->value;
+    else if (!strcmp(nvp->name, "monitored") && !strcmp(nvp->value, "True"))
+      res->monitored = true;
+    else if (!strcmp(nvp->name, "publishingInterval"))
+      params->publishingInterval = strtod(nvp->value, &endpt);
+    else if (!strcmp(nvp->name, "samplingInterval"))
+      params->samplingInterval = strtod(nvp->value, &endpt);
+    else if (!strcmp(nvp->name, "queueSize"))
+      params->queueSize = (uint32_t)strtoul(nvp->value, &endpt, 10);
+    else if (!strcmp(nvp->name, "discardOldest"))
+      params->discardOldest = (strcmp(nvp->value, "False") != 0);
+    else if (!strcmp(nvp->name, "deadbandType"))
+    {
+      if (!strcmp(nvp->value, "Absolute"))
+        params->deadbandType = UA_DEADBANDTYPE_ABSOLUTE;
+      else if (!strcmp(nvp->value, "Percent"))
+        params->deadbandType = UA_DEADBANDTYPE_PERCENT;
+    }
+    else if (!strcmp(nvp->name, "deadbandValue"))
+      params->deadbandValue = strtod(nvp->value, &endpt);
+    else if (!strcmp(nvp->name, "maxAge"))
+      res->maxAge = (uint32_t)strtoul(nvp->value, &endpt, 10);
+    else if (!strcmp(nvp->name, "pollInterval"))
+      res->pollInterval = (uint32_t)strtoul(nvp->value, &endpt, 10);
+    else if (!strcmp(nvp->name, "arrayType"))
+      res->arrayType = opcua_parse_array_type(nvp->value);
+    nvp = nvp->next;
+  }
+
+  id = (UA_UInt16)strtol(nsIndex,&endpt,10);
+  if (strcmp(IDType,"STRING") == 0)
+  {
+    nodeId = UA_NODEID_STRING(id, (char *)strID);
+  }
+  else if (strcmp(IDType,"NUMERIC") == 0)
+  {
+    nodeId = UA_NODEID_NUMERIC(id, (UA_UInt32)strtol(strID,&endpt,10));
+  }
+  else if (strcmp(IDType,"BYTESTRING") == 0)
+  {
+    nodeId = UA_NODEID_BYTESTRING(id, (char *)strID);
+  }
+  else if (strcmp(IDType,"GUID") == 0)
+  {
+    UA_Guid guid;
+    UA_Guid_init(&guid);
+    sscanf(strID,UA_PRINTF_GUID_FORMAT,UA_SCANF_GUID_DATA(guid));
+    nodeId = UA_NODEID_GUID(id, guid);
+  }
+
+  return nodeId;
+}
+
+/* Copies an attribute list, to compare later versions of it against */
+static edgex_nvpairs *copy_attrs(const edgex_nvpairs *attrs)
+{
+  edgex_nvpairs *copy = NULL;
+  edgex_nvpairs **pos = &copy;
+
+  for (; attrs; attrs = attrs->next)
+  {
+    *pos = malloc(sizeof(edgex_nvpairs));
+    (*pos)->name = strdup(attrs->name);
+    (*pos)->value = strdup(attrs->value);
+    (*pos)->next = NULL;
+    pos = &(*pos)->next;
+  }
+  return copy;
+}
+
+static void free_attrs(edgex_nvpairs *attrs)
+{
+  while (attrs)
+  {
+    edgex_nvpairs *next = attrs->next;
+    free(attrs->name);
+    free(attrs->value);
+    free(attrs);
+    attrs = next;
+  }
+}
+
+/*
+ * Attribute lists are compared by value, in order. The SDK may hand over a
+ * fresh copy of an unchanged profile, or reuse a freed list's address for a
+ * changed one, so their addresses say nothing.
+ */
+static bool attrs_equal(const edgex_nvpairs *a, const edgex_nvpairs *b)
+{
+  for (; a && b; a = a->next, b = b->next)
+  {
+    if (strcmp(a->name, b->name) || strcmp(a->value, b->value))
+      return false;
+  }
+  return a == NULL && b == NULL;
+}
+
+static void free_resource(opcua_resource *res)
+{
+  UA_NodeId_deleteMembers(&res->nodeId);
+  pthread_mutex_destroy(&res->last.mutex);
+  free(res->last.buffer);
+  free_attrs(res->attrs);
+  free(res);
+}
+
+void opcua_resource_hold(opcua_resource *res)
+{
+  atomic_fetch_add(&res->refs, 1);
+}
+
+void opcua_resource_release(opcua_resource *res)
+{
+  if (res && atomic_fetch_sub(&res->refs, 1) == 1)
+    free_resource(res);
+}
+
+static void release_resource(void *value)
+{
+  opcua_resource_release((opcua_resource *)value);
+}
+
+/*
+ * The cached resources of a device, with the modification time of the
+ * profile they were last brought into line with, 0 if it is not known
+ */
+typedef struct resource_device
+{
+  opcua_map resources;
+  uint64_t modified;
+} resource_device;
+
+static void free_resource_device(void *value)
+{
+  opcua_map_fini(&((resource_device *)value)->resources, release_resource);
+  free(value);
+}
+
+static bool monitor_params_equal(const opcua_monitor_params *a,
+  const opcua_monitor_params *b)
+{
+  return a->publishingInterval == b->publishingInterval &&
+    a->samplingInterval == b->samplingInterval &&
+    a->queueSize == b->queueSize && a->discardOldest == b->discardOldest &&
+    a->deadbandType == b->deadbandType &&
+    a->deadbandValue == b->deadbandValue;
+}
+
+/* Find the cached resource of a device. Caller holds the lock */
+static opcua_resource *find_resource(opcua_resource_cache *cache,
+  const char *devname, const char *resname)
+{
+  resource_device *dev = opcua_map_get(&cache->devices, devname);
+  return dev ? opcua_map_get(&dev->resources, resname) : NULL;
+}
+
+/* Record a change to a device's resources. Caller holds the lock */
+static void mark_changed(opcua_resource_cache *cache, const char *devname)
+{
+  if (!opcua_map_get(&cache->changed, devname))
+    opcua_map_put(&cache->changed, devname, cache);
+  atomic_fetch_add(&cache->changes, 1);
+}
+
+/*
+ * (Re)parse a resource into the cache, returning it with a reference taken
+ * for the caller. Caller holds the lock for writing. An entry whose node id
+ * or monitoring changes is replaced rather than updated, as other threads
+ * may be using it; the cache's reference to it is dropped, so it is freed
+ * once they are done. The subscriptions and polls using the old entry are
+ * out of date, so the device is marked as changed. So it is if a monitored
+ * or polled entry is added and the caller says that is a change: setting a
+ * device up adds its entries, a request for a resource not seen before
+ * means its profile has gained one.
+ */
+static opcua_resource *cache_resource(opcua_resource_cache *cache,
+  const char *devname, const char *resname, const edgex_nvpairs *attrs,
+  bool added)
+{
+  opcua_resource parsed;
+  UA_NodeId nodeId;
+  resource_device *dev = opcua_map_get(&cache->devices, devname);
+  opcua_resource *res;
+
+  if (!dev)
+  {
+    dev = malloc(sizeof(resource_device));
+    opcua_map_init(&dev->resources);
+    dev->modified = 0;
+    opcua_map_put(&cache->devices, devname, dev);
+  }
+
+  res = opcua_map_get(&dev->resources, resname);
+  if (res && attrs_equal(res->attrs, attrs))
+  {
+    opcua_resource_hold(res);
+    return res;
+  }
+
+  nodeId = opcua_parse_resource(attrs, &parsed);
+  if (res && res->monitored == parsed.monitored &&
+    monitor_params_equal(&res->params, &parsed.params) &&
+    res->arrayType == parsed.arrayType &&
+    res->pollInterval == parsed.pollInterval &&
+    UA_NodeId_equal(&res->nodeId, &nodeId))
+  {
+    /* A change of maxAge applies in place, keeping the last value */
+    res->maxAge = parsed.maxAge;
+    free_attrs(res->attrs);
+    res->attrs = copy_attrs(attrs);
+    opcua_resource_hold(res);
+    return res;
+  }
+
+  opcua_resource *old = res;
+  res = malloc(sizeof(opcua_resource));
+  memset(res, 0, sizeof(opcua_resource));
+  UA_NodeId_copy(&nodeId, &res->nodeId);
+  res->monitored = parsed.monitored;
+  res->params = parsed.params;
+  res->maxAge = parsed.maxAge;
+  res->pollInterval = parsed.pollInterval;
+  pthread_mutex_init(&res->last.mutex, NULL);
+  res->arrayType = parsed.arrayType;
+  res->attrs = copy_attrs(attrs);
+  /* One reference for the cache and one for the caller */
+  atomic_init(&res->refs, 2);
+  opcua_map_put(&dev->resources, resname, res);
+  if (old || (added && (res->monitored || res->pollInterval)))
+    mark_changed(cache, devname);
+  opcua_resource_release(old);
+  return res;
+}
+
+opcua_resource *opcua_get_device_resource(opcua_resource_cache *cache,
+  const char *devname, const edgex_deviceresource *resource)
+{
+  opcua_resource *res;
+
+  pthread_rwlock_wrlock(&cache->lock);
+  res = cache_resource(cache, devname, resource->name, resource->attributes,
+    false);
+  pthread_rwlock_unlock(&cache->lock);
+
+  return res;
+}
+
+opcua_resource *opcua_get_subscription_resource(opcua_resource_cache *cache,
+  const char *devname, const edgex_deviceresource *resource)
+{
+  opcua_resource *res = opcua_get_device_resource(cache, devname, resource);
+  if (!res->monitored)
+  {
+    opcua_resource_release(res);
+    res = NULL;
+  }
+  return res;
+}
+
+/*
+ * Get the cached resource for a request. The attributes are only parsed the
+ * first time a resource is seen; after that the entry is taken as it is, a
+ * change to the device's profile being applied by the device scan through
+ * opcua_resource_cache_update.
+ */
+opcua_resource *opcua_get_resource(opcua_resource_cache *cache,
+  const char *devname, const edgex_device_commandrequest *request)
+{
+  opcua_resource *res;
+
+  pthread_rwlock_rdlock(&cache->lock);
+  res = find_resource(cache, devname, request->resname);
+  if (res)
+    opcua_resource_hold(res);
+  pthread_rwlock_unlock(&cache->lock);
+  if (res)
+    return res;
+
+  pthread_rwlock_wrlock(&cache->lock);
+  res = cache_resource(cache, devname, request->resname, request->attributes,
+    true);
+  pthread_rwlock_unlock(&cache->lock);
+
+  return res;
+}
+
+void opcua_last_value_store(opcua_last_value *last,
+  const edgex_device_commandresult *value, uint64_t received)
+{
+  const void *data = NULL;
+  size_t len = 0;
+
+  if (value->type == String)
+  {
+    data = value->value.string_result;
+    len = strlen(value->value.string_result) + 1;
+  }
+  else if (value->type == Binary)
+  {
+    data = value->value.binary_result.bytes;
+    len = value->value.binary_result.size;
+  }
+
+  pthread_mutex_lock(&last->mutex);
+  last->value = *value;
+  if (data)
+  {
+    if (len > last->size)
+    {
+      last->buffer = realloc(last->buffer, len);
+      last->size = len;
+    }
+    memcpy(last->buffer, data, len);
+    if (value->type == String)
+      last->value.value.string_result = (char *)last->buffer;
+    else
+      last->value.value.binary_result.bytes = last->buffer;
+  }
+  last->received = received;
+  last->valid = true;
+  pthread_mutex_unlock(&last->mutex);
+}
+
+void opcua_last_value_invalidate(opcua_last_value *last)
+{
+  pthread_mutex_lock(&last->mutex);
+  last->valid = false;
+  pthread_mutex_unlock(&last->mutex);
+}
+
+bool opcua_last_value_get(opcua_last_value *last, uint32_t maxAge,
+  uint64_t now, edgex_device_commandresult *result)
+{
+  bool fresh;
+
+  pthread_mutex_lock(&last->mutex);
+  fresh = last->valid && now - last->received <= (uint64_t)maxAge * 1000;
+  if (fresh)
+  {
+    *result = last->value;
+    if (last->value.type == String)
+    {
+      result->value.string_result = strdup(last->value.value.string_result);
+    }
+    else if (last->value.type == Binary)
+    {
+      size_t size = last->value.value.binary_result.size;
+      result->value.binary_result.bytes = size ? malloc(size) : NULL;
+      if (size)
+        memcpy(result->value.binary_result.bytes, last->buffer, size);
+    }
+  }
+  pthread_mutex_unlock(&last->mutex);
+  return fresh;
+}
+
+static void collect_stale(const char *key, void *value, void *arg)
+{
+  void **args = (void **)arg;
+  opcua_map *names = (opcua_map *)args[0];
+  char ***pos = (char ***)args[1];
+
+  if (!opcua_map_get(names, key))
+    *(*pos)++ = strdup(key);
+}
+
+/*
+ * Adding entries to a device which had none is its setup rather than a
+ * change to it. A profile whose modification time is that of the last one
+ * applied is unchanged, and is passed over without comparing its resources.
+ */
+void opcua_resource_cache_update(opcua_resource_cache *cache,
+  const char *devname, const edgex_deviceprofile *profile)
+{
+  resource_device *dev;
+  opcua_map *resources;
+  opcua_map names;
+  bool existed;
+
+  pthread_rwlock_rdlock(&cache->lock);
+  dev = opcua_map_get(&cache->devices, devname);
+  if (dev && profile->modified && dev->modified == profile->modified)
+  {
+    pthread_rwlock_unlock(&cache->lock);
+    return;
+  }
+  pthread_rwlock_unlock(&cache->lock);
+
+  opcua_map_init(&names);
+  pthread_rwlock_wrlock(&cache->lock);
+  existed = (opcua_map_get(&cache->devices, devname) != NULL);
+  for (const edgex_deviceresource *resource = profile->device_resources;
+    resource; resource = resource->next)
+  {
+    opcua_resource_release(cache_resource(cache, devname, resource->name,
+      resource->attributes, existed));
+    opcua_map_put(&names, resource->name, cache);
+  }
+
+  dev = opcua_map_get(&cache->devices, devname);
+  resources = dev ? &dev->resources : NULL;
+  if (dev)
+    dev->modified = profile->modified;
+  if (resources && resources->count > names.count)
+  {
+    char **stale = calloc(resources->count, sizeof(char *));
+    char **end = stale;
+    void *args[2] = { &names, &end };
+
+    opcua_map_foreach(resources, collect_stale, args);
+    for (char **name = stale; name < end; name++)
+    {
+      opcua_resource *res = opcua_map_remove(resources, *name);
+      if (res->monitored || res->pollInterval)
+        mark_changed(cache, devname);
+      opcua_resource_release(res);
+      free(*name);
+    }
+    free(stale);
+  }
+  pthread_rwlock_unlock(&cache->lock);
+  opcua_map_fini(&names, NULL);
+}
+
+bool opcua_resource_cache_take_changed(opcua_resource_cache *cache,
+  const char *devname)
+{
+  bool changed;
+
+  pthread_rwlock_wrlock(&cache->lock);
+  changed = (opcua_map_remove(&cache->changed, devname) != NULL);
+  pthread_rwlock_unlock(&cache->lock);
+  return changed;
+}
+
+void opcua_resource_cache_init(opcua_resource_cache *cache)
+{
+  pthread_rwlock_init(&cache->lock, NULL);
+  opcua_map_init(&cache->devices);
+  opcua_map_init(&cache->changed);
+  atomic_init(&cache->changes, 0);
+}
+
+void opcua_resource_cache_fini(opcua_resource_cache *cache)
+{
+  pthread_rwlock_wrlock(&cache->lock);
+  opcua_map_fini(&cache->devices, free_resource_device);
+  opcua_map_fini(&cache->changed, NULL);
+  pthread_rwlock_unlock(&cache->lock);
+  pthread_rwlock_destroy(&cache->lock);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_RESOURCE_H_
+#define _OPCUA_RESOURCE_H_
+
+#include "edgex/devsdk.h"
+#include "open62541.h"
+#include "opcua_map.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Monitoring parameters requested by a resource's attributes. Negative
+ * intervals and a zero queue size leave the client's defaults in place.
+ */
+typedef struct opcua_monitor_params
+{
+  double publishingInterval;
+  double samplingInterval;
+  uint32_t queueSize;
+  bool discardOldest;
+  UA_DeadbandType deadbandType;
+  double deadbandValue;
+} opcua_monitor_params;
+
+/*
+ * The last value notified for a monitored resource. String and binary data
+ * is held in a buffer which is kept for reuse.
+ */
+typedef struct opcua_last_value
+{
+  pthread_mutex_t mutex;
+  bool valid;
+  /* Monotonic time the value was received, in microseconds */
+  uint64_t received;
+  edgex_device_commandresult value;
+  uint8_t *buffer;
+  size_t size;
+} opcua_last_value;
+
+/* A device resource whose attributes have been parsed into a node id */
+typedef struct opcua_resource
+{
+  UA_NodeId nodeId;
+  bool monitored;
+  opcua_monitor_params params;
+  /*
+   * Age in milliseconds up to which a GET may be answered from the last
+   * notified value, zero to always read from the server.
+   */
+  atomic_uint maxAge;
+  opcua_last_value last;
+  /* Interval in milliseconds at which the driver polls the resource, or 0 */
+  uint32_t pollInterval;
+  /* Element type of an array written from a Binary value, or NULL */
+  const UA_DataType *arrayType;
+  /* Copy of the attribute list the entry was parsed from */
+  edgex_nvpairs *attrs;
+  /* Held by the cache while the entry is current, and by each user */
+  atomic_uint refs;
+} opcua_resource;
+
+/*
+ * Resources parsed from device profiles, keyed by device then resource name.
+ * Lookups return a reference to the entry, which remains valid until it is
+ * released even if a profile update replaces it in the cache meanwhile.
+ * Devices whose profile update replaced an entry, or added or removed one
+ * which is monitored or polled, are recorded as changed.
+ */
+typedef struct opcua_resource_cache
+{
+  pthread_rwlock_t lock;
+  opcua_map devices;
+  opcua_map changed;
+  /* Count of the changes recorded, so users can tell when to look */
+  atomic_uint changes;
+} opcua_resource_cache;
+
+extern void opcua_resource_cache_init(opcua_resource_cache *cache);
+extern void opcua_resource_cache_fini(opcua_resource_cache *cache);
+
+/*
+ * Parse the node id held in a resource's attributes into res, along with
+ * whether the resource is monitored and how. The node id is also returned,
+ * and for STRING and BYTESTRING ids refers to the attribute's value.
+ */
+extern UA_NodeId opcua_parse_resource(const edgex_nvpairs *attrs,
+  opcua_resource *res);
+
+/* Returns the array element type of the given name, or NULL */
+extern const UA_DataType *opcua_parse_array_type(const char *name);
+
+/*
+ * Returns a reference to the cached resource for a request. An entry already
+ * cached is returned without looking at the request's attributes.
+ */
+extern opcua_resource *opcua_get_resource(opcua_resource_cache *cache,
+  const char *devname, const edgex_device_commandrequest *request);
+
+/*
+ * Returns a reference to the cached resource of a device resource from a
+ * device's profile
+ */
+extern opcua_resource *opcua_get_device_resource(opcua_resource_cache *cache,
+  const char *devname, const edgex_deviceresource *resource);
+
+/* As opcua_get_device_resource, but NULL if it is not monitored */
+extern opcua_resource *opcua_get_subscription_resource(
+  opcua_resource_cache *cache, const char *devname,
+  const edgex_deviceresource *resource);
+
+/*
+ * Bring a device's entries into line with its profile, parsing any new or
+ * updated resources and dropping those the profile no longer has. Nothing is
+ * done if the profile's modification time is that last applied.
+ */
+extern void opcua_resource_cache_update(opcua_resource_cache *cache,
+  const char *devname, const edgex_deviceprofile *profile);
+
+/*
+ * Whether the device has been recorded as changed since the last call,
+ * clearing the record
+ */
+extern bool opcua_resource_cache_take_changed(opcua_resource_cache *cache,
+  const char *devname);
+
+/* Takes another reference to a resource */
+extern void opcua_resource_hold(opcua_resource *res);
+
+/* Releases a reference to a resource, freeing it after the last one */
+extern void opcua_resource_release(opcua_resource *res);
+
+/* Records a resource's latest value, as received at the given time */
+extern void opcua_last_value_store(opcua_last_value *last,
+  const edgex_device_commandresult *value, uint64_t received);
+
+/* Discards a resource's last value, when it is no longer being notified */
+extern void opcua_last_value_invalidate(opcua_last_value *last);
+
+/*
+ * Copies a resource's last value if it was received no more than maxAge
+ * milliseconds before now. A string or binary value is copied for the
+ * caller to free. Returns false if there is no such value.
+ */
+extern bool opcua_last_value_get(opcua_last_value *last, uint32_t maxAge,
+  uint64_t now, edgex_device_commandresult *result);
+
+#endif
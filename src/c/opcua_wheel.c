@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include "opcua_wheel.h"
+
+#include <stdlib.h>
+
+void opcua_wheel_init(opcua_wheel *wheel, uint32_t nslots)
+{
+  wheel->nslots = nslots ? nslots : 1;
+  wheel->slots = calloc(wheel->nslots, sizeof(opcua_wheel_entry *));
+  wheel->cursor = 0;
+}
+
+void opcua_wheel_fini(opcua_wheel *wheel)
+{
+  free(wheel->slots);
+  wheel->slots = NULL;
+  wheel->nslots = 0;
+}
+
+void opcua_wheel_add(opcua_wheel *wheel, opcua_wheel_entry *entry,
+  uint32_t ticks)
+{
+  uint32_t slot;
+
+  if (ticks == 0)
+    ticks = 1;
+  /* A slot is next visited after 1 to nslots ticks, then every nslots */
+  slot = (uint32_t)(((uint64_t)wheel->cursor + ticks) % wheel->nslots);
+  entry->rounds = (ticks - 1) / wheel->nslots;
+  entry->next = wheel->slots[slot];
+  wheel->slots[slot] = entry;
+}
+
+opcua_wheel_entry *opcua_wheel_advance(opcua_wheel *wheel)
+{
+  opcua_wheel_entry **pos;
+  opcua_wheel_entry *expired = NULL;
+
+  wheel->cursor = (wheel->cursor + 1) % wheel->nslots;
+  pos = &wheel->slots[wheel->cursor];
+  while (*pos)
+  {
+    opcua_wheel_entry *entry = *pos;
+    if (entry->rounds)
+    {
+      entry->rounds--;
+      pos = &entry->next;
+    }
+    else
+    {
+      *pos = entry->next;
+      entry->next = expired;
+      expired = entry;
+    }
+  }
+  return expired;
+}
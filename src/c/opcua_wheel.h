@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2019
+ * IoTech Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _OPCUA_WHEEL_H_
+#define _OPCUA_WHEEL_H_
+
+#include <stdint.h>
+
+/*
+ * Hashed timer wheel. Entries are embedded in the caller's structures and
+ * are scheduled a whole number of ticks ahead; timeouts longer than one turn
+ * of the wheel wait out the extra turns in their slot. Adding and expiring
+ * an entry are constant time. The wheel does no locking of its own.
+ */
+
+typedef struct opcua_wheel_entry
+{
+  /* Whole turns of the wheel left before the entry expires */
+  uint32_t rounds;
+  struct opcua_wheel_entry *next;
+} opcua_wheel_entry;
+
+typedef struct opcua_wheel
+{
+  opcua_wheel_entry **slots;
+  uint32_t nslots;
+  uint32_t cursor;
+} opcua_wheel;
+
+extern void opcua_wheel_init(opcua_wheel *wheel, uint32_t nslots);
+extern void opcua_wheel_fini(opcua_wheel *wheel);
+
+/* Schedules an entry to expire after the given number of ticks, at least 1 */
+extern void opcua_wheel_add(opcua_wheel *wheel, opcua_wheel_entry *entry,
+  uint32_t ticks);
+
+/*
+ * Advances the wheel by one tick, returning the entries which have expired
+ * as a list linked by next. They are no longer scheduled.
+ */
+extern opcua_wheel_entry *opcua_wheel_advance(opcua_wheel *wheel);
+
+#endif